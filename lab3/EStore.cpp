@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "EStore.h"
 
@@ -16,17 +18,209 @@ Item::
 }
 
 
+OrderWaiter::
+OrderWaiter() : woken(false)
+{
+    smutex_init(&lock);
+    scond_init(&cond);
+    smutex_set_name(&lock, "EStore.order");
+    scond_set_name(&cond, "EStore.order");
+}
+
+OrderWaiter::
+~OrderWaiter()
+{
+    scond_destroy(&cond);
+    smutex_destroy(&lock);
+}
+
+void OrderWaiter::
+wake()
+{
+    smutex_lock(&lock);
+    woken = true;
+    scond_signal(&cond, &lock);
+    smutex_unlock(&lock);
+}
+
+void OrderWaiter::
+sleep()
+{
+    smutex_lock(&lock);
+    while (!woken)
+        scond_wait(&cond, &lock);
+    smutex_unlock(&lock);
+}
+
+BuyWaiter::
+BuyWaiter(double maxCost) : budget(maxCost), woken(false)
+{
+    next.resume = NULL;
+    next.context = NULL;
+    scond_init(&cond);
+    scond_set_name(&cond, "EStore.buyer");
+}
+
+BuyWaiter::
+BuyWaiter(double maxCost, const Continuation& k)
+    : budget(maxCost), woken(false), next(k)
+{
+    scond_init(&cond);
+    scond_set_name(&cond, "EStore.buyer");
+}
+
+BuyWaiter::
+~BuyWaiter()
+{
+    scond_destroy(&cond);
+}
+
+static const char* layoutNames[NUM_INVENTORY_LAYOUTS] = {
+    "aos",
+    "soa",
+};
+
+const char*
+inventory_layout_name(InventoryLayout layout)
+{
+    return layoutNames[layout];
+}
+
+bool
+inventory_layout_parse(const char* name, InventoryLayout* layout)
+{
+    for (int i = 0; i < NUM_INVENTORY_LAYOUTS; i++)
+    {
+        if (strcmp(name, layoutNames[i]) == 0)
+        {
+            *layout = (InventoryLayout) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+lower_budget(const BuyWaiter* a, const BuyWaiter* b)
+{
+    return a->budget < b->budget;
+}
+
+/*
+ * Remove one occurrence of w from list, if present.
+ */
+static void
+remove_waiter(vector<OrderWaiter*>& list, OrderWaiter* w)
+{
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        if (list[i] == w)
+        {
+            list[i] = list.back();
+            list.pop_back();
+            return;
+        }
+    }
+}
+
+
 EStore::
-EStore(bool enableFineMode)
-    : fineMode(enableFineMode)
+EStore(bool enableFineMode, const EStoreOptions& options)
+    : index(options.idSpace), inventory(new ItemSlot[index.capacity()]),
+      layout(options.layout),
+      columns(layout == LAYOUT_SOA
+              ? new ItemColumns(index.capacity()) : NULL),
+      itemVersions(new SeqCount[index.capacity()]),
+      idRange(options.idSpace), fineMode(enableFineMode),
+      numStripes(options.lockStripes > 0
+                 && options.lockStripes < index.capacity()
+                 ? options.lockStripes : index.capacity()),
+      waitForOrders(options.waitForOrders),
+      flatCombining(options.flatCombining && !enableFineMode),
+      shippingCost(3), storeDiscount(0), closed(false),
+      itemWaiters(new ItemWaiters*[index.capacity()]()), numResumable(0),
+      combiningSlots(flatCombining
+                     ? new CombiningSlot[MAX_COMBINING_THREADS] : NULL)
 {
-    // TODO: Your code here.
+    for (int i = 0; i < index.capacity(); i++)
+    {
+        smutex_init(&inventory[i].lock);
+        smutex_set_name(&inventory[i].lock, "EStore.item");
+    }
+    smutex_init(&storeLock);
+    smutex_set_name(&storeLock, "EStore.global");
+    smutex_init(&waitersLock);
+    smutex_set_name(&waitersLock, "EStore.waiters");
 }
 
 EStore::
 ~EStore()
 {
-    // TODO: Your code here.
+    smutex_destroy(&waitersLock);
+    smutex_destroy(&storeLock);
+    for (int i = 0; i < index.capacity(); i++)
+    {
+        smutex_destroy(&inventory[i].lock);
+        if (itemWaiters[i] == NULL)
+            continue;
+        // Continuation waiters still parked belong to the store.
+        vector<BuyWaiter*>& buyers = itemWaiters[i]->buyers;
+        for (size_t j = 0; j < buyers.size(); j++)
+        {
+            if (buyers[j]->parked())
+                delete buyers[j];
+        }
+        delete itemWaiters[i];
+    }
+    for (size_t i = 0; i < resumable.size(); i++)
+        delete resumable[i];
+    delete[] itemWaiters;
+    delete[] combiningSlots;
+    delete columns;
+    delete[] itemVersions;
+    delete[] inventory;
+}
+
+/*
+ * The waiter lists of a slot, created on first use. Caller holds
+ * lockFor(slot).
+ */
+ItemWaiters& EStore::
+waitersFor(int slot)
+{
+    if (itemWaiters[slot] == NULL)
+        itemWaiters[slot] = new ItemWaiters();
+    return *itemWaiters[slot];
+}
+
+/*
+ * Read the store-wide parameters as one consistent snapshot. Never
+ * blocks and never writes shared memory; retries while a setter is
+ * in progress.
+ */
+StorePricing EStore::
+pricing() const
+{
+    StorePricing p;
+    do
+    {
+        p.version = pricingLock.readBegin();
+        p.shippingCost = shippingCost.load(memory_order_relaxed);
+        p.storeDiscount = storeDiscount.load(memory_order_relaxed);
+        p.closed = closed.load(memory_order_relaxed);
+    } while (pricingLock.readRetry(p.version));
+    return p;
+}
+
+/*
+ * The overall cost of buying one unit of the item, given the
+ * store-wide discount and shipping cost.
+ */
+static double
+item_cost(const ItemRef& item, double storeDiscount, double shippingCost)
+{
+    return item.price * (1 - item.discount) * (1 - storeDiscount)
+        + shippingCost;
 }
 
 /*
@@ -50,6 +244,12 @@ EStore::
  *      removes the item from sale (at which point this method
  *      returns).
  *
+ *      A blocked buyer parks on the item's budget-ordered heap (see
+ *      ItemWaiters) and is woken only once the item is in stock at
+ *      a cost it can afford. Under flat combining only the first
+ *      attempt is combined; a buyer that must block takes the
+ *      monitor lock and parks as above.
+ *
  *      The overall cost of a purchase for a single item is defined
  *      as the current cost of the item times 1 - the store
  *      discount, plus the flat overall store shipping fee.
@@ -64,7 +264,151 @@ buyItem(int item_id, double budget)
 {
     assert(!fineModeEnabled());
 
-    // TODO: Your code here.
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_BUY_ITEM, slot);
+        op.value = budget;
+        combine(op);
+        if (op.finished)
+            return;
+        // The buyer has to wait, which a combiner cannot do for it:
+        // block as a plain monitor call would.
+    }
+
+    smutex_lock(&storeLock);
+    while (!tryBuyLocked(slot, budget))
+    {
+        // Whoever wakes us also takes us off the heap.
+        BuyWaiter waiter(budget);
+        parkBuyer(slot, &waiter);
+        while (!waiter.woken)
+            scond_wait(&waiter.cond, &storeLock);
+    }
+    smutex_unlock(&storeLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemOrPark --
+ *
+ *      buyItem without blocking, for a caller that would rather
+ *      get on with other work. If the purchase cannot go through
+ *      yet, it is parked on the item as a blocked buyItem would be,
+ *      but with the continuation k = park(arg) in place of a
+ *      sleeping thread. park is only called on this path, so a
+ *      purchase that goes through at once costs the caller nothing
+ *      extra; it runs under the store lock.
+ *
+ *      Once a supplier operation (or close) might let the purchase
+ *      through, the thread that made the change calls k.resume,
+ *      after releasing the store lock. The purchase is then not
+ *      retried: resume should arrange for the caller to call
+ *      buyItemOrPark again, which may park it once more if another
+ *      buyer got there first.
+ *
+ * Results:
+ *      True if the purchase is finished (bought, or not possible
+ *      because the item is not carried or the store is closed).
+ *      False if it was parked; k will be resumed exactly once.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+buyItemOrPark(int item_id, double budget, park_t park, void* arg)
+{
+    assert(!fineModeEnabled());
+
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return true;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_BUY_ITEM, slot);
+        op.value = budget;
+        combine(op);
+        if (op.finished)
+            return true;
+    }
+
+    smutex_lock(&storeLock);
+    bool finished = tryBuyLocked(slot, budget);
+    if (!finished)
+        parkBuyer(slot, new BuyWaiter(budget, park(arg)));
+    smutex_unlock(&storeLock);
+    return finished;
+}
+
+/*
+ * Put a buyer on the item's budget heap until wakeBuyers takes it
+ * off. Caller holds storeLock.
+ */
+void EStore::
+parkBuyer(int slot, BuyWaiter* waiter)
+{
+    ItemWaiters& waiters = waitersFor(slot);
+    if (!waiters.listed)
+    {
+        waiters.listed = true;
+        parkedSlots.push_back(slot);
+    }
+    waiters.buyers.push_back(waiter);
+    push_heap(waiters.buyers.begin(), waiters.buyers.end(), lower_budget);
+}
+
+/*
+ * Resume the continuations of the parked purchases that have been
+ * woken, and free their waiters. Called by every operation that can
+ * wake buyers, once it has released its locks, so that a
+ * continuation may take any lock without stalling the store. The
+ * caller may be a worker (say, a combiner), so a continuation must
+ * not wait for a queue to drain. Caller holds no store lock.
+ */
+void EStore::
+resumeParked()
+{
+    if (numResumable.load(memory_order_relaxed) == 0)
+        return;
+
+    vector<BuyWaiter*> ready;
+    smutex_lock(&storeLock);
+    ready.swap(resumable);
+    numResumable.store(0, memory_order_relaxed);
+    smutex_unlock(&storeLock);
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        Continuation k = ready[i]->next;
+        delete ready[i];
+        k.resume(k.context);
+    }
+}
+
+/*
+ * Buy one unit of the item in slot if it is in stock within budget.
+ * Returns false if the buyer must wait: the item is carried but out
+ * of stock or over budget, and the store is open. Caller holds
+ * storeLock.
+ */
+bool EStore::
+tryBuyLocked(int slot, double budget)
+{
+    ItemRef item = itemAt(slot);
+    if (!item.valid)
+        return true;
+
+    StorePricing p = pricing();
+    if (item.quantity > 0
+        && item_cost(item, p.storeDiscount, p.shippingCost) <= budget)
+    {
+        item.quantity--;
+        return true;
+    }
+    return p.closed;
 }
 
 /*
@@ -88,7 +432,7 @@ buyItem(int item_id, double budget)
  *
  *      For the purposes of this lab, it is OK for the store
  *      discount and shipping cost to change while an order is being
- *      processed.
+ *      processed. (This version does better: see below.)
  *
  *      The cost of a purchase of many items is the sum of the
  *      costs of purchasing each item individually. The purchase
@@ -103,21 +447,581 @@ buyItem(int item_id, double budget)
  *      are waiting to buy an order that includes that item should be
  *      signaled (though all such threads should be signaled).
  *
+ *      The waiting version is enabled by options.waitForOrders.
+ *      A parked order sleeps on its own OrderWaiter, linked into
+ *      the waiter list of each item it includes: addStock,
+ *      priceItem, discountItem and removeItem wake only the orders
+ *      on that item, while a store-wide price drop wakes all. If
+ *      an item is not carried, the order gives up.
+ *
  *      Challenge: For bonus points, ensure that the shipping cost
  *      and store discount does not change while processing an
  *      order.
  *
+ *      This version prices the order against one snapshot of the
+ *      pricing SeqLock and re-validates the snapshot, with all of
+ *      the order's stripes held, before buying anything.
+ *
+ *      The ids come in an ItemIdSet, already sorted and distinct,
+ *      and the stripe list lives on the stack, so an order that
+ *      does not park allocates nothing.
+ *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void EStore::
+buyManyItems(const ItemIdSet& item_ids, double budget)
+{
+    int slots[MAX_BUY_ITEM];
+    int stripes[MAX_BUY_ITEM];
+
+    buyOrder(item_ids.begin(), item_ids.size(), slots, stripes, budget);
+}
+
+/*
+ * The same, for an order of any size given as a vector of ids that
+ * may repeat. Unlike the ItemIdSet version this allocates.
+ */
+void EStore::
 buyManyItems(vector<int>* item_ids, double budget)
+{
+    vector<int> ids(*item_ids);
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+    vector<int> slots(ids.size());
+    vector<int> stripes(ids.size());
+    buyOrder(ids.data(), ids.size(), slots.data(), stripes.data(), budget);
+}
+
+/*
+ * The body of buyManyItems, for n distinct item ids. slots and
+ * stripes are scratch space for n ints each, so the caller decides
+ * whether they live on the stack.
+ */
+void EStore::
+buyOrder(const int* ids, int n, int* slots, int* stripes, double budget)
 {
     assert(fineModeEnabled());
 
-    // TODO: Your code here.
+    // An id the store has never carried has no slot, and the order
+    // gives up at once.
+    for (int i = 0; i < n; i++)
+    {
+        slots[i] = index.find(ids[i]);
+        if (slots[i] < 0)
+            return;
+        stripes[i] = slots[i] % numStripes;
+    }
+    sort(stripes, stripes + n);
+    int numLocked = unique(stripes, stripes + n) - stripes;
+
+    for (;;)
+    {
+        lockStripes(stripes, numLocked);
+
+        // Price the whole order against one pricing snapshot, and
+        // start over if the shipping cost or store discount changed
+        // meanwhile. The items themselves cannot change while their
+        // stripes are held, so the order is bought at prices that
+        // were all current at the same instant.
+        StorePricing p;
+        bool carried;
+        bool available;
+        double total;
+        do
+        {
+            p = pricing();
+            carried = true;
+            available = true;
+            total = 0;
+            for (int i = 0; i < n; i++)
+            {
+                ItemRef item = itemAt(slots[i]);
+                if (!item.valid)
+                    carried = false;
+                else if (item.quantity == 0)
+                    available = false;
+                else
+                    total += item_cost(item, p.storeDiscount, p.shippingCost);
+            }
+        } while (pricingChanged(p.version));
+
+        if (carried && available && total <= budget)
+        {
+            for (int i = 0; i < n; i++)
+                itemAt(slots[i]).quantity--;
+            unlockStripes(stripes, numLocked);
+            return;
+        }
+        if (!carried || p.closed || !waitForOrders)
+        {
+            unlockStripes(stripes, numLocked);
+            return;
+        }
+
+        // Park on every item in the order. Registering while the
+        // stripes are held means any later change to those items
+        // sees us; a store-wide change is caught by re-checking
+        // the pricing version after joining allWaiters.
+        OrderWaiter waiter;
+        for (int i = 0; i < n; i++)
+            waitersFor(slots[i]).orders.push_back(&waiter);
+        smutex_lock(&waitersLock);
+        allWaiters.push_back(&waiter);
+        smutex_unlock(&waitersLock);
+        unlockStripes(stripes, numLocked);
+
+        if (!pricingChanged(p.version))
+            waiter.sleep();
+
+        lockStripes(stripes, numLocked);
+        for (int i = 0; i < n; i++)
+            remove_waiter(itemWaiters[slots[i]]->orders, &waiter);
+        unlockStripes(stripes, numLocked);
+        smutex_lock(&waitersLock);
+        remove_waiter(allWaiters, &waiter);
+        smutex_unlock(&waitersLock);
+    }
+}
+
+/*
+ * Relaxed atomic accesses to the item fields that quotes read
+ * optimistically (valid, price and discount). Writers update them
+ * under the item's lock and SeqCount, but must still store them
+ * atomically, or the store would race with a quote's load; see
+ * SeqLock.
+ */
+template <typename T>
+static inline T
+load_relaxed(const T& field)
+{
+    T value;
+    __atomic_load(&field, &value, __ATOMIC_RELAXED);
+    return value;
+}
+
+template <typename T>
+static inline void
+store_relaxed(T& field, T value)
+{
+    __atomic_store(&field, &value, __ATOMIC_RELAXED);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quote --
+ *
+ *      Find what buying one unit of the item would cost right now,
+ *      as buyItem would charge it, without buying it or taking any
+ *      lock. Stock is not considered.
+ *
+ * Results:
+ *      True, with the cost in *cost, if the store carries the item;
+ *      false otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+quote(int item_id, double* cost)
+{
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return false;
+    return quoteSlots(&slot, 1, cost);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quoteMany --
+ *
+ *      Find what buyManyItems would charge for the order right now,
+ *      without buying it or taking any lock. All of the prices are
+ *      read as of one instant. Stock is not considered.
+ *
+ * Results:
+ *      True, with the total in *total, if the store carries every
+ *      item in the order; false otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+quoteMany(const ItemIdSet& item_ids, double* total)
+{
+    int slots[MAX_BUY_ITEM];
+
+    for (int i = 0; i < item_ids.size(); i++)
+    {
+        slots[i] = index.find(item_ids[i]);
+        if (slots[i] < 0)
+            return false;
+    }
+    return quoteSlots(slots, item_ids.size(), total);
+}
+
+/*
+ * The body of quote and quoteMany, for n <= MAX_BUY_ITEM slots: an
+ * optimistic read of the items and the store-wide pricing, retried
+ * until no writer touched any of them in the meantime.
+ */
+bool EStore::
+quoteSlots(const int* slots, int n, double* total)
+{
+    unsigned long versions[MAX_BUY_ITEM];
+    bool carried;
+    bool changed;
+
+    assert(n <= MAX_BUY_ITEM);
+    do
+    {
+        StorePricing p = pricing();
+        for (int i = 0; i < n; i++)
+            versions[i] = itemVersions[slots[i]].readBegin();
+
+        carried = true;
+        *total = 0;
+        for (int i = 0; i < n && carried; i++)
+        {
+            ItemRef item = itemAt(slots[i]);
+            carried = load_relaxed(item.valid);
+            *total += load_relaxed(item.price)
+                * (1 - load_relaxed(item.discount))
+                * (1 - p.storeDiscount) + p.shippingCost;
+        }
+
+        changed = pricingChanged(p.version);
+        for (int i = 0; i < n && !changed; i++)
+            changed = itemVersions[slots[i]].readRetry(versions[i]);
+    } while (changed);
+    return carried;
+}
+
+/*
+ * Lock the given item stripes, which must be sorted and distinct.
+ * Always locking in ascending order keeps concurrent orders from
+ * deadlocking.
+ */
+void EStore::
+lockStripes(const int* stripes, int n)
+{
+    for (int i = 0; i < n; i++)
+        smutex_lock(&inventory[stripes[i]].lock);
+}
+
+void EStore::
+unlockStripes(const int* stripes, int n)
+{
+    for (int i = n; i-- > 0; )
+        smutex_unlock(&inventory[stripes[i]].lock);
+}
+
+/*
+ * Lock the whole inventory: the monitor lock in coarse mode, every
+ * stripe, in ascending order, in fine mode.
+ */
+void EStore::
+lockInventory()
+{
+    if (!fineMode)
+    {
+        smutex_lock(&storeLock);
+        return;
+    }
+    for (int i = 0; i < numStripes; i++)
+        smutex_lock(&inventory[i].lock);
+}
+
+void EStore::
+unlockInventory()
+{
+    if (!fineMode)
+    {
+        smutex_unlock(&storeLock);
+        return;
+    }
+    for (int i = numStripes; i-- > 0; )
+        smutex_unlock(&inventory[i].lock);
+}
+
+/*
+ * Wake the purchases that may have become possible because the item
+ * in slot changed: the buyers that can now afford it in coarse mode,
+ * the orders parked on it in fine mode. Caller holds lockFor(slot).
+ */
+void EStore::
+wakeItemWaiters(int slot)
+{
+    if (itemWaiters[slot] == NULL)
+        return;
+    if (!fineMode)
+    {
+        wakeBuyers(slot);
+        return;
+    }
+
+    vector<OrderWaiter*>& orders = itemWaiters[slot]->orders;
+    for (size_t i = 0; i < orders.size(); i++)
+        orders[i]->wake();
+}
+
+/*
+ * Fine mode: wake every order parked on any of the n slots, each
+ * order once even if it includes several of them. Caller holds the
+ * locks of all the slots.
+ */
+void EStore::
+wakeOrders(const int* slots, int n)
+{
+    vector<OrderWaiter*> orders;
+    for (int i = 0; i < n; i++)
+    {
+        if (itemWaiters[slots[i]] == NULL)
+            continue;
+        vector<OrderWaiter*>& parked = itemWaiters[slots[i]]->orders;
+        orders.insert(orders.end(), parked.begin(), parked.end());
+    }
+    sort(orders.begin(), orders.end());
+    orders.erase(unique(orders.begin(), orders.end()), orders.end());
+    for (size_t i = 0; i < orders.size(); i++)
+        orders[i]->wake();
+}
+
+/*
+ * Coarse mode: wake the buyers parked on slot that can now buy its
+ * item, highest budget first and no more than there are units in
+ * stock. If the item was removed or the store closed, wake them all
+ * so they return. Caller holds storeLock.
+ */
+void EStore::
+wakeBuyers(int slot)
+{
+    if (itemWaiters[slot] == NULL)
+        return;
+
+    ItemRef item = itemAt(slot);
+    vector<BuyWaiter*>& buyers = itemWaiters[slot]->buyers;
+
+    StorePricing p = pricing();
+    bool all = !item.valid || p.closed;
+    if (!all && item.quantity == 0)
+        return;
+
+    double cost = item_cost(item, p.storeDiscount, p.shippingCost);
+    int woken = 0;
+    while (!buyers.empty()
+           && (all || (buyers.front()->budget >= cost
+                       && woken < item.quantity)))
+    {
+        BuyWaiter* waiter = buyers.front();
+        pop_heap(buyers.begin(), buyers.end(), lower_budget);
+        buyers.pop_back();
+        waiter->woken = true;
+        if (waiter->parked())
+        {
+            resumable.push_back(waiter);
+            numResumable.fetch_add(1, memory_order_relaxed);
+        }
+        else
+            scond_signal(&waiter->cond, &storeLock);
+        woken++;
+    }
+}
+
+/*
+ * Wake the purchases that may have become possible after a
+ * store-wide change. In coarse mode caller holds storeLock; in fine
+ * mode caller must not hold any item lock.
+ */
+void EStore::
+wakeAllWaiters()
+{
+    if (!fineMode)
+    {
+        // Visit only the slots with parked buyers, dropping the ones
+        // that no longer have any.
+        size_t kept = 0;
+        for (size_t i = 0; i < parkedSlots.size(); i++)
+        {
+            int slot = parkedSlots[i];
+            wakeBuyers(slot);
+            if (itemWaiters[slot]->buyers.empty())
+                itemWaiters[slot]->listed = false;
+            else
+                parkedSlots[kept++] = slot;
+        }
+        parkedSlots.resize(kept);
+        return;
+    }
+
+    smutex_lock(&waitersLock);
+    for (size_t i = 0; i < allWaiters.size(); i++)
+        allWaiters[i]->wake();
+    smutex_unlock(&waitersLock);
+}
+
+/*
+ * Each thread that publishes combined operations holds one of
+ * MAX_COMBINING_THREADS ids, the index of its CombiningSlot in every
+ * store, and gives it back when it exits. combiningIdLimit is one
+ * more than the highest id ever handed out, so combiners need only
+ * scan that far.
+ */
+static atomic<bool> combiningIdTaken[MAX_COMBINING_THREADS];
+static atomic<int> combiningIdLimit(0);
+
+struct CombiningId {
+    int id;
+
+    CombiningId() : id(-1) {
+        for (int i = 0; i < MAX_COMBINING_THREADS && id < 0; i++)
+        {
+            bool taken = false;
+            if (combiningIdTaken[i].compare_exchange_strong(taken, true))
+                id = i;
+        }
+        int limit = combiningIdLimit.load();
+        while (id >= limit
+               && !combiningIdLimit.compare_exchange_weak(limit, id + 1))
+            ;
+    }
+    ~CombiningId() {
+        if (id >= 0)
+            combiningIdTaken[id].store(false, memory_order_release);
+    }
+};
+
+/*
+ * The calling thread's combining id, or -1 if all are in use.
+ */
+static int
+combining_id()
+{
+    static thread_local CombiningId myId;
+    return myId.id;
+}
+
+// Spins on a pending operation before yielding the CPU between tries.
+#define COMBINE_SPINS 64
+
+// Most passes a combiner makes over the publication records.
+#define COMBINE_PASSES 3
+
+/*
+ * ------------------------------------------------------------------
+ * combine --
+ *
+ *      Run op by flat combining. The operation is published in the
+ *      calling thread's CombiningSlot; then, until some thread has
+ *      run it, the caller tries to take the monitor lock and, if it
+ *      gets it, becomes the combiner and runs every pending
+ *      operation itself. Otherwise it spins briefly, then yields.
+ *
+ *      Every operation still runs under storeLock, so combined
+ *      calls, threads blocked in buyItem and callers that take the
+ *      lock directly (close, applyUpdates, the catalog scans) all
+ *      see a monitor.
+ *
+ * Results:
+ *      None; op holds the outcome.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+combine(CombinedOp& op)
+{
+    int id = combining_id();
+    if (id < 0)
+    {
+        smutex_lock(&storeLock);
+        runCombined(op);
+        smutex_unlock(&storeLock);
+        resumeParked();
+        return;
+    }
+
+    CombiningSlot& mine = combiningSlots[id];
+    mine.op = op;
+    mine.state.store(COMBINE_PENDING, memory_order_release);
+
+    for (int spins = 0;
+         mine.state.load(memory_order_acquire) != COMBINE_DONE; spins++)
+    {
+        if (smutex_trylock(&storeLock))
+        {
+            combinePending();
+            smutex_unlock(&storeLock);
+        }
+        else if (spins < COMBINE_SPINS)
+            sthread_relax();
+        else
+            sthread_yield();
+    }
+    op = mine.op;
+    mine.state.store(COMBINE_IDLE, memory_order_relaxed);
+    resumeParked();
+}
+
+/*
+ * Run every published operation, repeating the scan while it keeps
+ * finding work, up to COMBINE_PASSES times. Caller holds storeLock.
+ */
+void EStore::
+combinePending()
+{
+    int limit = combiningIdLimit.load(memory_order_acquire);
+
+    for (int pass = 0; pass < COMBINE_PASSES; pass++)
+    {
+        bool found = false;
+        for (int i = 0; i < limit; i++)
+        {
+            CombiningSlot& slot = combiningSlots[i];
+            if (slot.state.load(memory_order_acquire) != COMBINE_PENDING)
+                continue;
+            runCombined(slot.op);
+            slot.state.store(COMBINE_DONE, memory_order_release);
+            found = true;
+        }
+        if (!found)
+            break;
+    }
+}
+
+/*
+ * Run one published operation. Caller holds storeLock.
+ */
+void EStore::
+runCombined(CombinedOp& op)
+{
+    switch (op.kind)
+    {
+        case OP_ADD_ITEM:
+            addItemLocked(op.slot, op.count, op.value, op.discount);
+            break;
+        case OP_REMOVE_ITEM:
+            removeItemLocked(op.slot);
+            break;
+        case OP_ADD_STOCK:
+            addStockLocked(op.slot, op.count);
+            break;
+        case OP_PRICE_ITEM:
+            priceItemLocked(op.slot, op.value);
+            break;
+        case OP_DISCOUNT_ITEM:
+            discountItemLocked(op.slot, op.value);
+            break;
+        case OP_SET_SHIPPING_COST:
+            setShippingCostLocked(op.value);
+            break;
+        case OP_SET_STORE_DISCOUNT:
+            setStoreDiscountLocked(op.value);
+            break;
+        case OP_BUY_ITEM:
+            op.finished = tryBuyLocked(op.slot, op.value);
+            break;
+    }
 }
 
 /*
@@ -126,7 +1030,8 @@ buyManyItems(vector<int>* item_ids, double budget)
  *
  *      Add the item to the store with the specified quantity,
  *      price, and discount. If the store already carries an item
- *      with the specified id, do nothing.
+ *      with the specified id, do nothing. If the inventory table
+ *      has no room for another id, do nothing either.
  *
  * Results:
  *      None.
@@ -136,7 +1041,44 @@ buyManyItems(vector<int>* item_ids, double budget)
 void EStore::
 addItem(int item_id, int quantity, double price, double discount)
 {
-    // TODO: Your code here.
+    int slot = index.claim(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_ADD_ITEM, slot);
+        op.count = quantity;
+        op.value = price;
+        op.discount = discount;
+        combine(op);
+        return;
+    }
+
+    smutex_t* lock = lockFor(slot);
+    smutex_lock(lock);
+    addItemLocked(slot, quantity, price, discount);
+    smutex_unlock(lock);
+}
+
+/*
+ * The bodies of addItem, removeItem, addStock, priceItem and
+ * discountItem, applied to the slot the item id maps to. Caller
+ * holds lockFor(slot).
+ */
+void EStore::
+addItemLocked(int slot, int quantity, double price, double discount)
+{
+    ItemRef item = itemAt(slot);
+    if (!item.valid)
+    {
+        itemVersions[slot].writeBegin();
+        store_relaxed(item.valid, true);
+        item.quantity = quantity;
+        store_relaxed(item.price, price);
+        store_relaxed(item.discount, discount);
+        itemVersions[slot].writeEnd();
+    }
 }
 
 /*
@@ -157,7 +1099,35 @@ addItem(int item_id, int quantity, double price, double discount)
 void EStore::
 removeItem(int item_id)
 {
-    // TODO: Your code here.
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_REMOVE_ITEM, slot);
+        combine(op);
+        return;
+    }
+
+    smutex_t* lock = lockFor(slot);
+    smutex_lock(lock);
+    removeItemLocked(slot);
+    smutex_unlock(lock);
+    resumeParked();
+}
+
+void EStore::
+removeItemLocked(int slot)
+{
+    ItemRef item = itemAt(slot);
+    if (item.valid)
+    {
+        itemVersions[slot].writeBegin();
+        store_relaxed(item.valid, false);
+        itemVersions[slot].writeEnd();
+        wakeItemWaiters(slot);
+    }
 }
 
 /*
@@ -175,7 +1145,35 @@ removeItem(int item_id)
 void EStore::
 addStock(int item_id, int count)
 {
-    // TODO: Your code here.
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_ADD_STOCK, slot);
+        op.count = count;
+        combine(op);
+        return;
+    }
+
+    smutex_t* lock = lockFor(slot);
+    smutex_lock(lock);
+    addStockLocked(slot, count);
+    smutex_unlock(lock);
+    resumeParked();
+}
+
+void EStore::
+addStockLocked(int slot, int count)
+{
+    ItemRef item = itemAt(slot);
+    if (item.valid)
+    {
+        item.quantity += count;
+        if (count > 0)
+            wakeItemWaiters(slot);
+    }
 }
 
 /*
@@ -195,7 +1193,38 @@ addStock(int item_id, int count)
 void EStore::
 priceItem(int item_id, double price)
 {
-    // TODO: Your code here.
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_PRICE_ITEM, slot);
+        op.value = price;
+        combine(op);
+        return;
+    }
+
+    smutex_t* lock = lockFor(slot);
+    smutex_lock(lock);
+    priceItemLocked(slot, price);
+    smutex_unlock(lock);
+    resumeParked();
+}
+
+void EStore::
+priceItemLocked(int slot, double price)
+{
+    ItemRef item = itemAt(slot);
+    if (item.valid)
+    {
+        bool decreased = price < item.price;
+        itemVersions[slot].writeBegin();
+        store_relaxed(item.price, price);
+        itemVersions[slot].writeEnd();
+        if (decreased)
+            wakeItemWaiters(slot);
+    }
 }
 
 /*
@@ -215,7 +1244,178 @@ priceItem(int item_id, double price)
 void EStore::
 discountItem(int item_id, double discount)
 {
-    // TODO: Your code here.
+    int slot = index.find(item_id);
+    if (slot < 0)
+        return;
+
+    if (flatCombining)
+    {
+        CombinedOp op(OP_DISCOUNT_ITEM, slot);
+        op.value = discount;
+        combine(op);
+        return;
+    }
+
+    smutex_t* lock = lockFor(slot);
+    smutex_lock(lock);
+    discountItemLocked(slot, discount);
+    smutex_unlock(lock);
+    resumeParked();
+}
+
+void EStore::
+discountItemLocked(int slot, double discount)
+{
+    ItemRef item = itemAt(slot);
+    if (item.valid)
+    {
+        bool increased = discount > item.discount;
+        itemVersions[slot].writeBegin();
+        store_relaxed(item.discount, discount);
+        itemVersions[slot].writeEnd();
+        if (increased)
+            wakeItemWaiters(slot);
+    }
+}
+
+/*
+ * One update of an applyUpdates batch, keyed for sorting: by stripe,
+ * then slot, then position in the batch, so each stripe's updates
+ * are contiguous and one item's updates keep their order.
+ */
+struct PendingUpdate {
+    int stripe;
+    int slot;
+    int index;
+
+    bool operator<(const PendingUpdate& other) const {
+        if (stripe != other.stripe)
+            return stripe < other.stripe;
+        if (slot != other.slot)
+            return slot < other.slot;
+        return index < other.index;
+    }
+};
+
+/*
+ * Apply one update to a carried item. Returns true if the change may
+ * let a parked purchase go through, by the same rules as addStock,
+ * priceItem and discountItem.
+ */
+static bool
+apply_update(ItemRef& item, const Update& update)
+{
+    switch (update.kind)
+    {
+        case UPDATE_ADD_STOCK:
+            item.quantity += update.count;
+            return update.count > 0;
+        case UPDATE_PRICE:
+        {
+            bool decreased = update.value < item.price;
+            store_relaxed(item.price, update.value);
+            return decreased;
+        }
+        case UPDATE_DISCOUNT:
+        {
+            bool increased = update.value > item.discount;
+            store_relaxed(item.discount, update.value);
+            return increased;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyUpdates --
+ *
+ *      Apply a supplier feed of n stock, price and discount updates
+ *      (see Update). Each update has the effect of the matching
+ *      addStock, priceItem or discountItem call, and updates to the
+ *      same item take effect in feed order; updates to items the
+ *      store does not carry are ignored.
+ *
+ *      Rather than taking a lock per update, the updates are sorted
+ *      by stripe and each stripe is locked once for all of its
+ *      updates (in coarse mode, the monitor lock once for the whole
+ *      feed). Purchases parked on the changed items are woken once
+ *      per critical section, after all of its updates, instead of
+ *      once per update.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+applyUpdates(const Update* updates, int n)
+{
+    PendingUpdate local[MAX_UPDATES];
+    vector<PendingUpdate> spill;
+    PendingUpdate* pending = local;
+    if (n > MAX_UPDATES)
+    {
+        spill.resize(n);
+        pending = spill.data();
+    }
+
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int slot = index.find(updates[i].item_id);
+        if (slot < 0)
+            continue;
+        pending[m].stripe = fineMode ? slot % numStripes : 0;
+        pending[m].slot = slot;
+        pending[m].index = i;
+        m++;
+    }
+    sort(pending, pending + m);
+
+    // The slots changed in the current critical section in a way
+    // that may let a parked purchase through.
+    vector<int> changed;
+    for (int begin = 0, end; begin < m; begin = end)
+    {
+        end = begin + 1;
+        while (end < m && pending[end].stripe == pending[begin].stripe)
+            end++;
+
+        smutex_t* lock = lockFor(pending[begin].slot);
+        smutex_lock(lock);
+        changed.clear();
+        for (int i = begin; i < end; i++)
+        {
+            int slot = pending[i].slot;
+            const Update& update = updates[pending[i].index];
+            ItemRef item = itemAt(slot);
+            if (!item.valid)
+                continue;
+
+            bool repriced = update.kind != UPDATE_ADD_STOCK;
+            if (repriced)
+                itemVersions[slot].writeBegin();
+            bool wake = apply_update(item, update);
+            if (repriced)
+                itemVersions[slot].writeEnd();
+            if (!wake)
+                continue;
+            if (changed.empty() || changed.back() != slot)
+                changed.push_back(slot);
+        }
+
+        if (fineMode)
+            wakeOrders(changed.data(), changed.size());
+        else
+        {
+            for (size_t i = 0; i < changed.size(); i++)
+                wakeBuyers(changed[i]);
+        }
+        smutex_unlock(lock);
+    }
+    resumeParked();
 }
 
 /*
@@ -233,7 +1433,36 @@ discountItem(int item_id, double discount)
 void EStore::
 setShippingCost(double cost)
 {
-    // TODO: Your code here.
+    if (flatCombining)
+    {
+        CombinedOp op(OP_SET_SHIPPING_COST);
+        op.value = cost;
+        combine(op);
+        return;
+    }
+
+    if (!fineMode)
+        smutex_lock(&storeLock);
+    setShippingCostLocked(cost);
+    if (!fineMode)
+        smutex_unlock(&storeLock);
+    resumeParked();
+}
+
+/*
+ * The body of setShippingCost. In coarse mode caller holds
+ * storeLock; in fine mode caller must not hold any item lock.
+ */
+void EStore::
+setShippingCostLocked(double cost)
+{
+    pricingLock.writeLock();
+    bool decreased = cost < shippingCost.load(memory_order_relaxed);
+    shippingCost.store(cost, memory_order_relaxed);
+    pricingLock.writeUnlock();
+
+    if (decreased)
+        wakeAllWaiters();
 }
 
 /*
@@ -251,7 +1480,198 @@ setShippingCost(double cost)
 void EStore::
 setStoreDiscount(double discount)
 {
-    // TODO: Your code here.
+    if (flatCombining)
+    {
+        CombinedOp op(OP_SET_STORE_DISCOUNT);
+        op.value = discount;
+        combine(op);
+        return;
+    }
+
+    if (!fineMode)
+        smutex_lock(&storeLock);
+    setStoreDiscountLocked(discount);
+    if (!fineMode)
+        smutex_unlock(&storeLock);
+    resumeParked();
+}
+
+/*
+ * The body of setStoreDiscount; locking as for setShippingCostLocked.
+ */
+void EStore::
+setStoreDiscountLocked(double discount)
+{
+    pricingLock.writeLock();
+    bool increased = discount > storeDiscount.load(memory_order_relaxed);
+    storeDiscount.store(discount, memory_order_relaxed);
+    pricingLock.writeUnlock();
+
+    if (increased)
+        wakeAllWaiters();
+}
+
+
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Shut the store. Purchases blocked waiting for stock or a
+ *      lower price give up and return, and later purchases never
+ *      block. The simulation closes the store once every supplier
+ *      has exited, since nothing can unblock a waiting customer
+ *      after that.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+close()
+{
+    if (!fineMode)
+        smutex_lock(&storeLock);
+
+    pricingLock.writeLock();
+    closed.store(true, memory_order_relaxed);
+    pricingLock.writeUnlock();
+
+    wakeAllWaiters();
+    if (!fineMode)
+        smutex_unlock(&storeLock);
+    resumeParked();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * effectivePrices --
+ *
+ *      List every item the store carries along with the overall
+ *      cost of buying one unit of it, as buyItem would charge it
+ *      right now.
+ *
+ * Results:
+ *      The ids go to *ids and their costs, in the same order, to
+ *      *costs; both are overwritten.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+effectivePrices(vector<int>* ids, vector<double>* costs)
+{
+    int n = index.capacity();
+    ids->clear();
+    costs->clear();
+
+    lockInventory();
+    StorePricing p = pricing();
+    if (layout == LAYOUT_SOA)
+    {
+        // Price every slot in one pass, then keep the carried ones.
+        costs->resize(n);
+        inventory_effective_prices(*columns, n, p.storeDiscount,
+                                   p.shippingCost, costs->data());
+        size_t kept = 0;
+        for (int slot = 0; slot < n; slot++)
+        {
+            if (!columns->valid[slot])
+                continue;
+            ids->push_back(index.idAt(slot));
+            (*costs)[kept++] = (*costs)[slot];
+        }
+        costs->resize(kept);
+    }
+    else
+    {
+        for (int slot = 0; slot < n; slot++)
+        {
+            ItemRef item = itemAt(slot);
+            if (!item.valid)
+                continue;
+            ids->push_back(index.idAt(slot));
+            costs->push_back(item_cost(item, p.storeDiscount,
+                                       p.shippingCost));
+        }
+    }
+    unlockInventory();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemsUnderBudget --
+ *
+ *      Find the items that buyItem could buy right now on the given
+ *      budget: carried, in stock, and costing no more than budget.
+ *
+ * Results:
+ *      The ids go to *ids, which is overwritten.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+itemsUnderBudget(double budget, vector<int>* ids)
+{
+    int n = index.capacity();
+    ids->clear();
+
+    lockInventory();
+    StorePricing p = pricing();
+    if (layout == LAYOUT_SOA)
+    {
+        ids->resize(n);
+        int found = inventory_under_budget(*columns, n, p.storeDiscount,
+                                           p.shippingCost, budget,
+                                           ids->data());
+        ids->resize(found);
+        for (int i = 0; i < found; i++)
+            (*ids)[i] = index.idAt((*ids)[i]);
+    }
+    else
+    {
+        for (int slot = 0; slot < n; slot++)
+        {
+            ItemRef item = itemAt(slot);
+            if (item.valid && item.quantity > 0
+                && item_cost(item, p.storeDiscount, p.shippingCost) <= budget)
+                ids->push_back(index.idAt(slot));
+        }
+    }
+    unlockInventory();
 }
 
+/*
+ * ------------------------------------------------------------------
+ * stockValue --
+ *
+ *      Value everything in stock at current item prices (price
+ *      times 1 - the item discount), before the store discount and
+ *      shipping.
+ *
+ * Results:
+ *      The total value of the stock.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::
+stockValue()
+{
+    int n = index.capacity();
+    double total = 0;
 
+    lockInventory();
+    if (layout == LAYOUT_SOA)
+        total = inventory_stock_value(*columns, n);
+    else
+    {
+        for (int slot = 0; slot < n; slot++)
+        {
+            ItemRef item = itemAt(slot);
+            if (item.valid)
+                total += item.quantity * (item.price * (1 - item.discount));
+        }
+    }
+    unlockInventory();
+    return total;
+}
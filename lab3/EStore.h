@@ -2,7 +2,11 @@
 
 #include <vector>
 
+#include "InventoryKernels.h"
+#include "ItemIndex.h"
 #include "Request.h"
+#include "SeqLock.h"
+#include "sthread.h"
 
 /* 
  * ------------------------------------------------------------------
@@ -37,6 +41,259 @@ class Item {
 
 };
 
+/*
+ * ------------------------------------------------------------------
+ * ItemRef --
+ *
+ *      The fields of one inventory item, wherever the store's
+ *      layout keeps them: in an Item, or spread over ItemColumns.
+ *      Reads and writes go straight through to the store.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemRef {
+    bool& valid;
+    int& quantity;
+    double& price;
+    double& discount;
+};
+
+/*
+ * How an EStore lays out its inventory.
+ *
+ *      LAYOUT_AOS -- an array of Items, each in the ItemSlot next to
+ *                    its lock. Best for requests on single items.
+ *      LAYOUT_SOA -- ItemColumns, one array per field, so the bulk
+ *                    catalog scans run as vector loops. The ItemSlot
+ *                    then holds only the lock.
+ */
+enum InventoryLayout {
+    LAYOUT_AOS = 0,
+    LAYOUT_SOA,
+    NUM_INVENTORY_LAYOUTS
+};
+
+const char* inventory_layout_name(InventoryLayout layout);
+bool inventory_layout_parse(const char* name, InventoryLayout* layout);
+
+/*
+ * ------------------------------------------------------------------
+ * ItemSlot --
+ *
+ *      One inventory entry plus the lock that guards it in fine
+ *      mode, padded to a cache line so that threads working on
+ *      neighbouring items do not false-share. With fewer lock
+ *      stripes than slots, slot i is guarded by the lock in slot
+ *      i % stripes and the remaining locks go unused. Under
+ *      LAYOUT_SOA the item itself lives in the store's ItemColumns.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) ItemSlot {
+    smutex_t lock;
+    Item item;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * OrderWaiter --
+ *
+ *      A buyManyItems call parked until its order may be fillable.
+ *      It is linked into the waiter list of every item in the order
+ *      and into the store-wide list, and sleeps on its own condition
+ *      variable so that a change to one item wakes only the orders
+ *      that include it.
+ *
+ * ------------------------------------------------------------------
+ */
+struct OrderWaiter {
+    smutex_t lock;
+    scond_t cond;
+    bool woken;
+
+    OrderWaiter();
+    ~OrderWaiter();
+
+    void wake();
+    void sleep();
+};
+
+/*
+ * What to do when a purchase parked by EStore::buyItemOrPark may go
+ * through: call resume(context), once.
+ */
+struct Continuation {
+    void (*resume)(void* context);
+    void* context;
+};
+
+/*
+ * Called by EStore::buyItemOrPark, under the store lock, only once a
+ * purchase has to wait, to make the Continuation it is parked with.
+ * arg is whatever the caller passed to buyItemOrPark.
+ */
+typedef Continuation (*park_t) (void* arg);
+
+/*
+ * ------------------------------------------------------------------
+ * BuyWaiter --
+ *
+ *      A buyItem call parked in coarse mode until the item is in
+ *      stock at a cost within its budget. It sleeps on its own
+ *      condition variable, paired with the store monitor lock, so
+ *      that a price change can wake just the buyers who can now
+ *      afford the item.
+ *
+ *      A waiter parked by buyItemOrPark has no thread behind it:
+ *      it carries a continuation instead, is owned by the store,
+ *      and waking it means resuming the continuation once the
+ *      store lock is released.
+ *
+ * ------------------------------------------------------------------
+ */
+struct BuyWaiter {
+    double budget;
+    scond_t cond;
+    bool woken;
+    Continuation next;
+
+    explicit BuyWaiter(double maxCost);
+    BuyWaiter(double maxCost, const Continuation& k);
+    ~BuyWaiter();
+
+    bool parked() const { return next.resume != NULL; }
+};
+
+/*
+ * The purchases parked on one item, guarded by the item's lock (the
+ * monitor lock in coarse mode). Kept apart from ItemSlot so the slot
+ * stays one cache line, and allocated only for items that ever had a
+ * purchase parked on them.
+ *
+ *      orders -- fine mode: parked buyManyItems orders that include
+ *                this item.
+ *      buyers -- coarse mode: parked buyItem calls, as a max-heap on
+ *                budget, so the buyers that can afford a new price
+ *                are always a prefix of the heap.
+ *      listed -- coarse mode: the item is on the store's list of
+ *                items with parked buyers.
+ */
+struct alignas(CACHE_LINE_SIZE) ItemWaiters {
+    std::vector<OrderWaiter*> orders;
+    std::vector<BuyWaiter*> buyers;
+    bool listed;
+
+    ItemWaiters() : listed(false) { }
+};
+
+// Most threads that can publish operations for flat combining at
+// once; any beyond that take the monitor lock directly.
+#define MAX_COMBINING_THREADS 64
+
+/*
+ * ------------------------------------------------------------------
+ * CombinedOp --
+ *
+ *      A coarse-mode store operation as published for flat
+ *      combining: which method, the inventory slot it applies to
+ *      and its arguments. value is the price, discount, shipping
+ *      cost or budget; discount is only used by OP_ADD_ITEM. For
+ *      OP_BUY_ITEM the combiner sets finished to false if the buyer
+ *      must block.
+ *
+ * ------------------------------------------------------------------
+ */
+enum CombinedOpKind {
+    OP_ADD_ITEM = 0,
+    OP_REMOVE_ITEM,
+    OP_ADD_STOCK,
+    OP_PRICE_ITEM,
+    OP_DISCOUNT_ITEM,
+    OP_SET_SHIPPING_COST,
+    OP_SET_STORE_DISCOUNT,
+    OP_BUY_ITEM
+};
+
+struct CombinedOp {
+    CombinedOpKind kind;
+    int slot;
+    int count;
+    double value;
+    double discount;
+    bool finished;
+
+    explicit CombinedOp(CombinedOpKind opKind, int opSlot = -1)
+        : kind(opKind), slot(opSlot), count(0), value(0), discount(0),
+          finished(true) { }
+};
+
+/*
+ * One thread's publication record, on its own cache line. The owner
+ * fills in op and sets state to COMBINE_PENDING; whichever thread
+ * holds the monitor lock runs op and sets state to COMBINE_DONE.
+ */
+enum CombiningState {
+    COMBINE_IDLE = 0,
+    COMBINE_PENDING,
+    COMBINE_DONE
+};
+
+struct alignas(CACHE_LINE_SIZE) CombiningSlot {
+    std::atomic<int> state;
+    CombinedOp op;
+
+    CombiningSlot() : state(COMBINE_IDLE), op(OP_ADD_ITEM) { }
+};
+
+/*
+ * A consistent snapshot of the store-wide pricing parameters, read
+ * under the store's pricing SeqLock. version identifies the snapshot:
+ * if the SeqLock has moved past it, some parameter changed since.
+ */
+struct StorePricing {
+    double shippingCost;
+    double storeDiscount;
+    bool closed;
+    unsigned long version;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EStoreOptions --
+ *
+ *      Tuning knobs for an EStore, fixed at construction.
+ *
+ *      idSpace        -- the number of distinct item ids the store
+ *                        can carry; the inventory table is sized
+ *                        for it. Ids need not be below idSpace.
+ *      lockStripes    -- number of distinct item locks in fine
+ *                        mode, from 1 (one lock for the whole
+ *                        inventory) up to one lock per inventory
+ *                        slot, which is also what 0 (the default)
+ *                        gives.
+ *      waitForOrders  -- in fine mode, buyManyItems blocks until
+ *                        the order can be filled instead of giving
+ *                        up (the "challenge" version).
+ *      layout         -- how the inventory is laid out in memory;
+ *                        see InventoryLayout.
+ *      flatCombining  -- in coarse mode, run operations by flat
+ *                        combining rather than having every thread
+ *                        take the monitor lock itself.
+ *
+ * ------------------------------------------------------------------
+ */
+struct EStoreOptions {
+    int idSpace;
+    int lockStripes;
+    bool waitForOrders;
+    InventoryLayout layout;
+    bool flatCombining;
+
+    EStoreOptions()
+        : idSpace(INVENTORY_SIZE), lockStripes(0), waitForOrders(false),
+          layout(LAYOUT_AOS), flatCombining(false) { }
+};
+
 
 /* 
  * ------------------------------------------------------------------
@@ -46,13 +303,20 @@ class Item {
  *      Customers and suppliers interact with the store through the
  *      methods of this class.
  *
- *      Items in the inventory are indexed by their item IDs.
+ *      Items in the inventory are indexed by their item IDs: an
+ *      ItemIndex maps each id the store has ever carried to a slot
+ *      of the inventory table, without locking. Internally items
+ *      are addressed by slot.
  *
  *      The store discount should initially be set to 0.
  *      The shipping cost should initially be set to 3.
  *
  *      If fineMode is false, then this class functions strictly as
  *      a monitor. The buyItem method only functions in this mode.
+ *      With options.flatCombining, threads publish their calls in
+ *      per-thread CombiningSlots and whichever thread gets the
+ *      monitor lock runs every published call in one pass, so the
+ *      store's state stays in one cache while the lock is held.
  *
  *      If fineMode is true, simultaneous requests for:
  *          - addItem,
@@ -61,31 +325,156 @@ class Item {
  *          - discountItem
  *      that reference different item ids must process at the same
  *      time. The buyManyItems method only functions in this mode.
+ *      Each slot is guarded by one of options.lockStripes locks.
+ *
+ *      In both modes, the store-wide shipping cost and discount sit
+ *      behind a SeqLock, so purchases read a consistent pair without
+ *      taking a shared lock or writing a shared cache line.
+ *
+ *      Quotes (quote, quoteMany) take no lock at all. Each slot has
+ *      a SeqCount that writers bump, under the item's lock, around
+ *      any change to whether the item is carried or to its price or
+ *      discount (not its stock), and a quote retries if that count
+ *      or the pricing SeqLock moved while it read. Quotes therefore
+ *      never block one another, and contend with suppliers only for
+ *      the length of a field update.
+ *
+ *      The catalog scans (effectivePrices, itemsUnderBudget,
+ *      stockValue) lock the whole inventory and see one consistent
+ *      state of it. They work under either layout but are written
+ *      for LAYOUT_SOA, where they are vector loops over ItemColumns.
+ *      In fine mode a scan takes every stripe lock, so a store that
+ *      is scanned often wants far fewer stripes than slots.
+ *
+ *      Once close() is called, blocked purchases give up and new
+ *      ones never block.
  *
  * ------------------------------------------------------------------
  */
 class EStore {
     private:
-    Item inventory[INVENTORY_SIZE];
+    ItemIndex index;
+    ItemSlot* inventory;
+    const InventoryLayout layout;
+    ItemColumns* columns;
+
+    // Bumped around changes to an item's valid, price or discount
+    // fields, so quotes can read them optimistically.
+    SeqCount* itemVersions;
+    const int idRange;
     const bool fineMode;
-    // TODO: More needed here.
+    const int numStripes;
+    const bool waitForOrders;
+    const bool flatCombining;
+
+    // Coarse mode: the monitor lock for the whole store.
+    smutex_t storeLock;
+
+    // Store-wide parameters. Written under pricingLock (and, in
+    // coarse mode, storeLock); read through pricing().
+    SeqLock pricingLock;
+    std::atomic<double> shippingCost;
+    std::atomic<double> storeDiscount;
+    std::atomic<bool> closed;
+
+    // Purchases parked on each slot, or NULL; see ItemWaiters.
+    ItemWaiters** itemWaiters;
+
+    // Coarse mode: the slots that may have parked buyers.
+    std::vector<int> parkedSlots;
+
+    // Coarse mode: continuation waiters woken but not yet resumed,
+    // guarded by storeLock, and how many there are.
+    std::vector<BuyWaiter*> resumable;
+    std::atomic<int> numResumable;
+
+    // Flat combining: one publication record per combining thread.
+    CombiningSlot* combiningSlots;
+
+    // Fine mode: every order parked in buyManyItems.
+    smutex_t waitersLock;
+    std::vector<OrderWaiter*> allWaiters;
+
+    smutex_t* itemLock(int slot) {
+        return &inventory[slot % numStripes].lock;
+    }
+    smutex_t* lockFor(int slot) {
+        return fineMode ? itemLock(slot) : &storeLock;
+    }
+    ItemRef itemAt(int slot) {
+        if (layout == LAYOUT_SOA)
+            return ItemRef { columns->valid[slot], columns->quantity[slot],
+                             columns->price[slot], columns->discount[slot] };
+        Item& item = inventory[slot].item;
+        return ItemRef { item.valid, item.quantity, item.price,
+                         item.discount };
+    }
+    ItemWaiters& waitersFor(int slot);
+    void lockInventory();
+    void unlockInventory();
+    void lockStripes(const int* stripes, int n);
+    void unlockStripes(const int* stripes, int n);
+    void buyOrder(const int* ids, int n, int* slots, int* stripes,
+                  double budget);
+    bool quoteSlots(const int* slots, int n, double* total);
+    void wakeItemWaiters(int slot);
+    void wakeOrders(const int* slots, int n);
+    void wakeBuyers(int slot);
+    void wakeAllWaiters();
+    void parkBuyer(int slot, BuyWaiter* waiter);
+    void resumeParked();
+
+    void combine(CombinedOp& op);
+    void combinePending();
+    void runCombined(CombinedOp& op);
+
+    bool tryBuyLocked(int slot, double budget);
+    void addItemLocked(int slot, int quantity, double price,
+                       double discount);
+    void removeItemLocked(int slot);
+    void addStockLocked(int slot, int count);
+    void priceItemLocked(int slot, double price);
+    void discountItemLocked(int slot, double discount);
+    void setShippingCostLocked(double cost);
+    void setStoreDiscountLocked(double discount);
+
+    StorePricing pricing() const;
+    bool pricingChanged(unsigned long version) const {
+        return pricingLock.readRetry(version);
+    }
 
     public:
 
-    explicit EStore(bool enableFineMode);
+    explicit EStore(bool enableFineMode,
+                    const EStoreOptions& options = EStoreOptions());
     ~EStore();
 
     void buyItem(int item_id, double budget);
+    bool buyItemOrPark(int item_id, double budget, park_t park, void* arg);
     void addItem(int item_id, int quantity, double price, double discount);
     void removeItem(int item_id);
     void addStock(int item_id, int count);
     void priceItem(int item_id, double price);
     void discountItem(int item_id, double discount);
+    void applyUpdates(const Update* updates, int n);
     void setShippingCost(double price);
     void setStoreDiscount(double discount);
 
+    void buyManyItems(const ItemIdSet& item_ids, double budget);
     void buyManyItems(std::vector<int>* item_ids, double budget);
 
+    bool quote(int item_id, double* cost);
+    bool quoteMany(const ItemIdSet& item_ids, double* total);
+
+    void close();
+
+    void effectivePrices(std::vector<int>* ids, std::vector<double>* costs);
+    void itemsUnderBudget(double budget, std::vector<int>* ids);
+    double stockValue();
+
     bool fineModeEnabled() const { return fineMode; }
+    int stripeCount() const { return numStripes; }
+    int idSpace() const { return idRange; }
+    InventoryLayout inventoryLayout() const { return layout; }
 };
 
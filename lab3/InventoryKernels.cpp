@@ -0,0 +1,194 @@
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "InventoryKernels.h"
+
+ItemColumns::
+ItemColumns(int n)
+    : valid(new bool[n]()), quantity(new int[n]()), price(new double[n]()),
+      discount(new double[n]())
+{
+}
+
+ItemColumns::
+~ItemColumns()
+{
+    delete[] discount;
+    delete[] price;
+    delete[] quantity;
+    delete[] valid;
+}
+
+/*
+ * The cost of one unit of slot i. Written out in the same order as
+ * the vector code, so both round alike.
+ */
+static inline double
+unit_cost(const ItemColumns& cols, int i, double storeFactor,
+          double shippingCost)
+{
+    return cols.price[i] * (1 - cols.discount[i]) * storeFactor
+        + shippingCost;
+}
+
+#ifdef __SSE2__
+
+/*
+ * The costs of slots i and i + 1.
+ */
+static inline __m128d
+pair_cost(const ItemColumns& cols, int i, __m128d storeFactor,
+          __m128d shippingCost)
+{
+    __m128d price = _mm_loadu_pd(cols.price + i);
+    __m128d discount = _mm_loadu_pd(cols.discount + i);
+    __m128d cost = _mm_mul_pd(price, _mm_sub_pd(_mm_set1_pd(1), discount));
+    return _mm_add_pd(_mm_mul_pd(cost, storeFactor), shippingCost);
+}
+
+/*
+ * All ones in each of the low two 32-bit lanes whose slot (i or
+ * i + 1) is carried, zero otherwise.
+ */
+static inline __m128i
+pair_valid(const ItemColumns& cols, int i)
+{
+    unsigned short bytes;
+    memcpy(&bytes, cols.valid + i, sizeof(bytes));
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i valid = _mm_cvtsi32_si128(bytes);
+    valid = _mm_unpacklo_epi8(valid, zero);
+    valid = _mm_unpacklo_epi16(valid, zero);
+    return _mm_cmpgt_epi32(valid, zero);
+}
+
+#endif
+
+/*
+ * ------------------------------------------------------------------
+ * inventory_effective_prices --
+ *
+ *      Price every one of the first n slots against the given
+ *      store-wide discount and shipping cost.
+ *
+ * Results:
+ *      None; the costs go to out[0..n-1].
+ *
+ * ------------------------------------------------------------------
+ */
+void
+inventory_effective_prices(const ItemColumns& cols, int n,
+                           double storeDiscount, double shippingCost,
+                           double* out)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128d factor2 = _mm_set1_pd(1 - storeDiscount);
+    __m128d shipping2 = _mm_set1_pd(shippingCost);
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(out + i, pair_cost(cols, i, factor2, shipping2));
+#endif
+    for (; i < n; i++)
+        out[i] = unit_cost(cols, i, 1 - storeDiscount, shippingCost);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * inventory_under_budget --
+ *
+ *      Find the slots among the first n whose item is carried, in
+ *      stock and costs at most budget. The vector loop tests two
+ *      slots at a time without branching and only branches to
+ *      record a match.
+ *
+ * Results:
+ *      The number of matching slots, which are written to out in
+ *      ascending order. out must have room for n.
+ *
+ * ------------------------------------------------------------------
+ */
+int
+inventory_under_budget(const ItemColumns& cols, int n, double storeDiscount,
+                       double shippingCost, double budget, int* out)
+{
+    int found = 0;
+    int i = 0;
+#ifdef __SSE2__
+    __m128d factor2 = _mm_set1_pd(1 - storeDiscount);
+    __m128d shipping2 = _mm_set1_pd(shippingCost);
+    __m128d budget2 = _mm_set1_pd(budget);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i quantity =
+            _mm_loadl_epi64((const __m128i*) (cols.quantity + i));
+        __m128i avail = _mm_and_si128(pair_valid(cols, i),
+                                      _mm_cmpgt_epi32(quantity, zero));
+        avail = _mm_unpacklo_epi32(avail, avail);
+
+        __m128d affordable =
+            _mm_cmple_pd(pair_cost(cols, i, factor2, shipping2), budget2);
+        int mask = _mm_movemask_pd(
+            _mm_and_pd(affordable, _mm_castsi128_pd(avail)));
+        if (mask & 1)
+            out[found++] = i;
+        if (mask & 2)
+            out[found++] = i + 1;
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (cols.valid[i] && cols.quantity[i] > 0
+            && unit_cost(cols, i, 1 - storeDiscount, shippingCost) <= budget)
+            out[found++] = i;
+    }
+    return found;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * inventory_stock_value --
+ *
+ *      Value the stock of the first n slots at current item prices,
+ *      before the store discount and shipping.
+ *
+ * Results:
+ *      The total value.
+ *
+ * ------------------------------------------------------------------
+ */
+double
+inventory_stock_value(const ItemColumns& cols, int n)
+{
+    double total = 0;
+    int i = 0;
+#ifdef __SSE2__
+    __m128d one = _mm_set1_pd(1);
+    __m128d sum = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i quantity =
+            _mm_loadl_epi64((const __m128i*) (cols.quantity + i));
+        quantity = _mm_and_si128(quantity, pair_valid(cols, i));
+
+        __m128d price = _mm_loadu_pd(cols.price + i);
+        __m128d discount = _mm_loadu_pd(cols.discount + i);
+        __m128d unit = _mm_mul_pd(price, _mm_sub_pd(one, discount));
+        sum = _mm_add_pd(sum, _mm_mul_pd(_mm_cvtepi32_pd(quantity), unit));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    total = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++)
+    {
+        if (cols.valid[i])
+            total += cols.quantity[i]
+                * (cols.price[i] * (1 - cols.discount[i]));
+    }
+    return total;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * ------------------------------------------------------------------
+ * ItemColumns --
+ *
+ *      The inventory stored as parallel arrays, one entry per slot,
+ *      so that a scan over one field touches only that field and a
+ *      loop over the catalog can be vectorized. Entry i of every
+ *      array describes the item in slot i.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemColumns {
+    bool* valid;
+    int* quantity;
+    double* price;
+    double* discount;
+
+    explicit ItemColumns(int n);
+    ~ItemColumns();
+};
+
+/*
+ * Bulk pricing over the first n slots of an ItemColumns. These use
+ * SSE2 where the compiler targets it (always on x86-64) and plain
+ * loops elsewhere; both give the same answers, save for rounding in
+ * the order inventory_stock_value adds things up.
+ *
+ *      inventory_effective_prices -- out[i] = the cost of buying one
+ *              unit of slot i, price * (1 - discount) *
+ *              (1 - storeDiscount) + shippingCost. Computed for every
+ *              slot, carried or not.
+ *      inventory_under_budget -- write to out, in slot order, every
+ *              slot that is carried, in stock and costs no more than
+ *              budget. Returns how many there are.
+ *      inventory_stock_value -- the sum over carried items of
+ *              quantity * price * (1 - discount).
+ */
+void inventory_effective_prices(const ItemColumns& cols, int n,
+                                double storeDiscount, double shippingCost,
+                                double* out);
+int inventory_under_budget(const ItemColumns& cols, int n,
+                           double storeDiscount, double shippingCost,
+                           double budget, int* out);
+double inventory_stock_value(const ItemColumns& cols, int n);
@@ -0,0 +1,103 @@
+#include <cassert>
+
+#include "ItemIndex.h"
+
+using namespace std;
+
+/*
+ * The smallest power of two that is at least twice maxItems.
+ */
+static int
+table_size(int maxItems)
+{
+    int cap = 2;
+    while (cap < 2 * maxItems)
+        cap <<= 1;
+    return cap;
+}
+
+ItemIndex::
+ItemIndex(int maxItems)
+    : mask(table_size(maxItems) - 1)
+{
+    assert(maxItems > 0 && maxItems <= (1 << 29));
+    keys = new atomic<int>[capacity()];
+    for (int i = 0; i < capacity(); i++)
+        keys[i].store(EMPTY, memory_order_relaxed);
+}
+
+ItemIndex::
+~ItemIndex()
+{
+    delete[] keys;
+}
+
+/*
+ * The first slot to probe for item_id (Fibonacci hashing, so that
+ * runs of consecutive ids spread over the table).
+ */
+int ItemIndex::
+home(int item_id) const
+{
+    unsigned long long h = (unsigned) item_id * 0x9e3779b97f4a7c15ULL;
+    return (int) (h >> 32) & mask;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * find --
+ *
+ *      Look up the slot of item_id without locking.
+ *
+ * Results:
+ *      The slot, or -1 if item_id has never been claimed.
+ *
+ * ------------------------------------------------------------------
+ */
+int ItemIndex::
+find(int item_id) const
+{
+    assert(item_id != EMPTY);
+    for (int i = 0, slot = home(item_id); i <= mask; i++)
+    {
+        int key = keys[slot].load(memory_order_acquire);
+        if (key == item_id)
+            return slot;
+        if (key == EMPTY)
+            return -1;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * claim --
+ *
+ *      Find the slot of item_id, claiming the first empty slot on
+ *      its probe sequence if it has none. Concurrent claims of the
+ *      same id follow the same sequence and race for the same empty
+ *      slot, so they always agree on the result.
+ *
+ * Results:
+ *      The slot, or -1 if the table is full.
+ *
+ * ------------------------------------------------------------------
+ */
+int ItemIndex::
+claim(int item_id)
+{
+    assert(item_id != EMPTY);
+    for (int i = 0, slot = home(item_id); i <= mask; i++)
+    {
+        int key = keys[slot].load(memory_order_acquire);
+        if (key == EMPTY
+            && keys[slot].compare_exchange_strong(key, item_id,
+                                                  memory_order_acq_rel))
+            return slot;
+        if (key == item_id)
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * ------------------------------------------------------------------
+ * ItemIndex --
+ *
+ *      Maps item ids to slots of a fixed-size table by open
+ *      addressing with linear probing, so the inventory can hold any
+ *      ids rather than just 0..INVENTORY_SIZE-1.
+ *
+ *      A slot's key is claimed once, by compare-and-swap, and never
+ *      released: removing an item only marks it invalid and keeps
+ *      its slot for when it comes back. With no deletions and no
+ *      resizing, find() is a lock-free probe that any thread may run
+ *      at any time, and a slot number stays valid for good.
+ *
+ *      The table is sized at construction to at least twice the
+ *      number of distinct ids it must hold, which keeps probe
+ *      sequences short.
+ *
+ * ------------------------------------------------------------------
+ */
+class ItemIndex {
+    private:
+    std::atomic<int>* keys;
+    const int mask;
+
+    int home(int item_id) const;
+
+    public:
+    // The key of a slot no id has claimed.
+    static const int EMPTY = -1;
+
+    explicit ItemIndex(int maxItems);
+    ~ItemIndex();
+
+    int find(int item_id) const;
+    int claim(int item_id);
+
+    int capacity() const { return mask + 1; }
+
+    // The id that claimed slot, or EMPTY.
+    int idAt(int slot) const {
+        return keys[slot].load(std::memory_order_acquire);
+    }
+};
@@ -0,0 +1,296 @@
+#include <cstring>
+
+#include "LatencyStats.h"
+#include "sthread.h"
+
+LatencyHistogram::
+LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::
+reset()
+{
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    sum = 0;
+    max = 0;
+}
+
+/*
+ * A value with its top bit at position msb >= LATENCY_SUB_BITS lands
+ * in power-of-two range msb - LATENCY_SUB_BITS + 1, in the sub-bucket
+ * given by its next LATENCY_SUB_BITS bits.
+ */
+int LatencyHistogram::
+bucketOf(unsigned long long ns)
+{
+    if (ns < LATENCY_SUB_BUCKETS)
+        return (int) ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    int shift = msb - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB_BUCKETS + (int) (ns >> shift);
+}
+
+/*
+ * The largest value that falls in the bucket.
+ */
+unsigned long long LatencyHistogram::
+bucketTop(int bucket)
+{
+    if (bucket < 2 * LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    unsigned long long low =
+        (unsigned long long) (bucket - shift * LATENCY_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::
+record(unsigned long long ns)
+{
+    counts[bucketOf(ns)]++;
+    total++;
+    sum += ns;
+    if (ns > max)
+        max = ns;
+}
+
+void LatencyHistogram::
+merge(const LatencyHistogram& other)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    if (other.max > max)
+        max = other.max;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * percentile --
+ *
+ *      The smallest bucket bound at or below which at least
+ *      fraction p of the samples lie, capped at the largest sample.
+ *
+ * Results:
+ *      A latency in nanoseconds, or 0 if nothing was recorded.
+ *
+ * ------------------------------------------------------------------
+ */
+unsigned long long LatencyHistogram::
+percentile(double p) const
+{
+    if (total == 0)
+        return 0;
+
+    unsigned long rank = (unsigned long) (p * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen > rank)
+            return bucketTop(i) < max ? bucketTop(i) : max;
+    }
+    return max;
+}
+
+/*
+ * One thread's histograms. A thread allocates its recorder on its
+ * first sample and links it into a global list, so recording itself
+ * takes no lock; the recorders outlive their threads so they can be
+ * merged at shutdown.
+ */
+struct LatencyRecorder {
+    LatencyHistogram hist[NUM_TASK_KINDS][NUM_LATENCY_METRICS];
+    LatencyRecorder* next;
+};
+
+struct RecorderList {
+    smutex_t lock;
+    LatencyRecorder* head;
+
+    RecorderList() : head(NULL) {
+        smutex_init(&lock);
+        smutex_set_name(&lock, "LatencyStats");
+    }
+};
+
+// Never destroyed, so threads still running at exit stay safe.
+static RecorderList&
+recorder_list()
+{
+    static RecorderList* list = new RecorderList();
+    return *list;
+}
+
+static thread_local LatencyRecorder* myRecorder = NULL;
+
+void
+latency_record(TaskKind kind, LatencyMetric metric, unsigned long long ns)
+{
+    if (myRecorder == NULL)
+    {
+        RecorderList& list = recorder_list();
+        myRecorder = new LatencyRecorder();
+        smutex_lock(&list.lock);
+        myRecorder->next = list.head;
+        list.head = myRecorder;
+        smutex_unlock(&list.lock);
+    }
+    myRecorder->hist[kind][metric].record(ns);
+}
+
+/*
+ * Merge every thread's histograms into merged. Only meaningful once
+ * the recording threads are done.
+ */
+static void
+merge_all(LatencyHistogram merged[NUM_TASK_KINDS][NUM_LATENCY_METRICS])
+{
+    RecorderList& list = recorder_list();
+
+    smutex_lock(&list.lock);
+    for (LatencyRecorder* r = list.head; r != NULL; r = r->next)
+        for (int k = 0; k < NUM_TASK_KINDS; k++)
+            for (int m = 0; m < NUM_LATENCY_METRICS; m++)
+                merged[k][m].merge(r->hist[k][m]);
+    smutex_unlock(&list.lock);
+}
+
+/*
+ * Merge the samples of one metric, across every task kind and
+ * thread, into *out.
+ */
+void
+latency_merge(LatencyMetric metric, LatencyHistogram* out)
+{
+    RecorderList& list = recorder_list();
+
+    smutex_lock(&list.lock);
+    for (LatencyRecorder* r = list.head; r != NULL; r = r->next)
+        for (int k = 0; k < NUM_TASK_KINDS; k++)
+            out->merge(r->hist[k][metric]);
+    smutex_unlock(&list.lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * latency_report --
+ *
+ *      Merge the per-thread histograms and print the p50, p99 and
+ *      p99.9 queueing delay and service time of each kind of task
+ *      that ran, in microseconds.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+latency_report(FILE* out)
+{
+    LatencyHistogram (*merged)[NUM_LATENCY_METRICS] =
+        new LatencyHistogram[NUM_TASK_KINDS][NUM_LATENCY_METRICS];
+    merge_all(merged);
+
+    fprintf(out, "%-22s %8s %28s %28s\n", "latency (us)", "count",
+            "queue p50/p99/p99.9", "service p50/p99/p99.9");
+    for (int k = 0; k < NUM_TASK_KINDS; k++)
+    {
+        LatencyHistogram& queue = merged[k][LATENCY_QUEUE];
+        LatencyHistogram& service = merged[k][LATENCY_SERVICE];
+        if (service.count() == 0)
+            continue;
+
+        fprintf(out, "%-22s %8lu %8.1f %9.1f %9.1f %8.1f %9.1f %9.1f\n",
+                task_kind_name((TaskKind) k), service.count(),
+                queue.percentile(0.50) / 1e3, queue.percentile(0.99) / 1e3,
+                queue.percentile(0.999) / 1e3,
+                service.percentile(0.50) / 1e3,
+                service.percentile(0.99) / 1e3,
+                service.percentile(0.999) / 1e3);
+    }
+    delete[] merged;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * latency_write_csv --
+ *
+ *      Merge the per-thread histograms and write one CSV row per
+ *      task kind and metric with samples, all times in nanoseconds.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+latency_write_csv(FILE* out)
+{
+    static const char* metricNames[NUM_LATENCY_METRICS] = {
+        "queue",
+        "service",
+    };
+
+    LatencyHistogram (*merged)[NUM_LATENCY_METRICS] =
+        new LatencyHistogram[NUM_TASK_KINDS][NUM_LATENCY_METRICS];
+    merge_all(merged);
+
+    fprintf(out, "kind,metric,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    for (int k = 0; k < NUM_TASK_KINDS; k++)
+    {
+        for (int m = 0; m < NUM_LATENCY_METRICS; m++)
+        {
+            LatencyHistogram& h = merged[k][m];
+            if (h.count() == 0)
+                continue;
+            fprintf(out, "%s,%s,%lu,%.0f,%llu,%llu,%llu,%llu\n",
+                    task_kind_name((TaskKind) k), metricNames[m], h.count(),
+                    h.mean(), h.percentile(0.50), h.percentile(0.99),
+                    h.percentile(0.999), h.maxValue());
+        }
+    }
+    delete[] merged;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * latency_reset --
+ *
+ *      Discard every sample recorded so far, along with the
+ *      recorders of the threads that recorded them, so that one
+ *      process can measure several runs. No thread may be recording
+ *      while this runs, and any thread that recorded must not record
+ *      again.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+latency_reset(void)
+{
+    RecorderList& list = recorder_list();
+
+    smutex_lock(&list.lock);
+    while (list.head != NULL)
+    {
+        LatencyRecorder* r = list.head;
+        list.head = r->next;
+        delete r;
+    }
+    smutex_unlock(&list.lock);
+    myRecorder = NULL;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdio>
+
+#include "TaskQueue.h"
+
+// Sub-buckets per power of two: values are kept to within 1/32.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+
+// Values of 2^LATENCY_MAX_BITS ns (about 18 minutes) and up share the
+// last bucket.
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/*
+ * What a latency sample measures.
+ *
+ *      LATENCY_QUEUE   -- from enqueue (or, under an open-loop arrival
+ *                         process, the scheduled arrival) until a
+ *                         worker dequeued the task.
+ *      LATENCY_SERVICE -- from handler start to handler end.
+ */
+enum LatencyMetric {
+    LATENCY_QUEUE = 0,
+    LATENCY_SERVICE,
+    NUM_LATENCY_METRICS
+};
+
+/*
+ * ------------------------------------------------------------------
+ * LatencyHistogram --
+ *
+ *      A log-linear histogram of nanosecond latencies, after HdrHistogram:
+ *      values below LATENCY_SUB_BUCKETS ns get a bucket each, and every
+ *      power of two above that is split into LATENCY_SUB_BUCKETS equal
+ *      buckets, so any percentile is exact to within about 3%.
+ *
+ *      A histogram is not thread safe. Each thread records into its
+ *      own and they are merged once the threads are done.
+ *
+ * ------------------------------------------------------------------
+ */
+class LatencyHistogram {
+    private:
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long total;
+    unsigned long long sum;
+    unsigned long long max;
+
+    static int bucketOf(unsigned long long ns);
+    static unsigned long long bucketTop(int bucket);
+
+    public:
+    LatencyHistogram();
+
+    void record(unsigned long long ns);
+    void merge(const LatencyHistogram& other);
+    void reset();
+
+    unsigned long count() const { return total; }
+    unsigned long long maxValue() const { return max; }
+    double mean() const { return total ? (double) sum / total : 0; }
+    unsigned long long percentile(double p) const;
+};
+
+void latency_record(TaskKind kind, LatencyMetric metric, unsigned long long ns);
+void latency_merge(LatencyMetric metric, LatencyHistogram* out);
+void latency_report(FILE* out);
+void latency_write_csv(FILE* out);
+void latency_reset(void);
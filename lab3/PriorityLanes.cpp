@@ -0,0 +1,207 @@
+#include "PriorityLanes.h"
+
+PriorityLanes::
+PriorityLanes()
+    : count(0), agingNs(DEFAULT_PRIORITY_AGING_NS)
+{
+    smutex_init(&lock);
+    scond_init(&notEmpty);
+}
+
+PriorityLanes::
+~PriorityLanes()
+{
+    scond_destroy(&notEmpty);
+    smutex_destroy(&lock);
+}
+
+void PriorityLanes::
+setName(const char* name)
+{
+    smutex_set_name(&lock, name);
+    scond_set_name(&notEmpty, name);
+}
+
+/*
+ * Set the aging interval. Tasks already queued keep their deadlines.
+ */
+void PriorityLanes::
+setAging(unsigned long long ns)
+{
+    smutex_lock(&lock);
+    agingNs = ns;
+    smutex_unlock(&lock);
+}
+
+/*
+ * Append the task to its lane. Caller holds lock.
+ */
+void PriorityLanes::
+push(const Task& task, unsigned long long now)
+{
+    int lane = task.priority;
+    if (lane < 0 || lane >= NUM_TASK_PRIORITIES)
+        lane = PRIORITY_NORMAL;
+
+    Entry entry;
+    entry.task = task;
+    entry.deadline = now + lane * agingNs;
+    lanes[lane].push_back(entry);
+    count++;
+}
+
+/*
+ * Remove and return the lane head with the earliest deadline. Each
+ * lane is in deadline order, so only the heads need comparing.
+ * Caller holds lock and the queue is not empty.
+ */
+Task PriorityLanes::
+pop()
+{
+    int best = -1;
+    for (int i = 0; i < NUM_TASK_PRIORITIES; i++)
+    {
+        if (lanes[i].empty())
+            continue;
+        if (best < 0
+            || lanes[i].front().deadline < lanes[best].front().deadline)
+            best = i;
+    }
+
+    Task task = lanes[best].front().task;
+    lanes[best].pop_front();
+    count--;
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue --
+ *
+ *      Add the task to the lane of its priority.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityLanes::
+enqueue(const Task& task)
+{
+    unsigned long long now = sthread_now_ns();
+
+    smutex_lock(&lock);
+    push(task, now);
+    scond_signal(&notEmpty, &lock);
+    smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeue --
+ *
+ *      Remove the most pressing task: the lane head with the
+ *      earliest deadline. If the queue is empty, block until a task
+ *      is added.
+ *
+ * Results:
+ *      The task.
+ *
+ * ------------------------------------------------------------------
+ */
+Task PriorityLanes::
+dequeue()
+{
+    smutex_lock(&lock);
+    while (count == 0)
+        scond_wait(&notEmpty, &lock);
+    Task task = pop();
+    smutex_unlock(&lock);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Add n tasks, each to the lane of its priority, with a single
+ *      lock acquisition and a single wakeup. The tasks all arrive
+ *      at the same instant.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityLanes::
+enqueueBatch(const Task* tasks, int n)
+{
+    unsigned long long now = sthread_now_ns();
+
+    smutex_lock(&lock);
+    for (int i = 0; i < n; i++)
+        push(tasks[i], now);
+    if (n == 1)
+        scond_signal(&notEmpty, &lock);
+    else
+        scond_broadcast(&notEmpty, &lock);
+    smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueBatch --
+ *
+ *      Remove up to max tasks into out, most pressing first. If the
+ *      queue is empty, block until a task is added.
+ *
+ * Results:
+ *      The number of tasks removed (at least one).
+ *
+ * ------------------------------------------------------------------
+ */
+int PriorityLanes::
+dequeueBatch(Task* out, int max)
+{
+    smutex_lock(&lock);
+    while (count == 0)
+        scond_wait(&notEmpty, &lock);
+    int n = 0;
+    while (n < max && count > 0)
+        out[n++] = pop();
+    smutex_unlock(&lock);
+    return n;
+}
+
+/*
+ * Remove the oldest task of the least urgent non-empty lane without
+ * blocking, for a producer that must make room. Returns false if the
+ * queue is empty.
+ */
+bool PriorityLanes::
+evict(Task* task)
+{
+    bool found = false;
+
+    smutex_lock(&lock);
+    for (int i = NUM_TASK_PRIORITIES - 1; i >= 0 && !found; i--)
+    {
+        if (lanes[i].empty())
+            continue;
+        *task = lanes[i].front().task;
+        lanes[i].pop_front();
+        count--;
+        found = true;
+    }
+    smutex_unlock(&lock);
+    return found;
+}
+
+int PriorityLanes::
+size()
+{
+    smutex_lock(&lock);
+    int n = count;
+    smutex_unlock(&lock);
+    return n;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <deque>
+
+#include "TaskQueue.h"
+#include "sthread.h"
+
+// Default extra delay a task tolerates per priority level below
+// PRIORITY_URGENT, in nanoseconds.
+#define DEFAULT_PRIORITY_AGING_NS 2000000ULL
+
+/*
+ * ------------------------------------------------------------------
+ * PriorityLanes --
+ *
+ *      A monitor-based task queue with one FIFO lane per
+ *      TaskPriority. A task entering lane p is given a deadline of
+ *      its arrival time plus p times the aging interval, and
+ *      dequeue takes the lane head with the earliest deadline
+ *      (ties going to the more urgent lane).
+ *
+ *      So a task overtakes lower-priority tasks that arrived less
+ *      than an aging interval per level before it, but nothing
+ *      waits behind newer arrivals forever: once a bulk task has
+ *      waited out its slack, it is served before any task that
+ *      arrives later, whatever its priority.
+ *
+ * ------------------------------------------------------------------
+ */
+class PriorityLanes {
+    private:
+    struct Entry {
+        Task task;
+        unsigned long long deadline;
+    };
+
+    std::deque<Entry> lanes[NUM_TASK_PRIORITIES];
+    int count;
+    unsigned long long agingNs;
+
+    smutex_t lock;
+    scond_t notEmpty;
+
+    void push(const Task& task, unsigned long long now);
+    Task pop();
+
+    public:
+    PriorityLanes();
+    ~PriorityLanes();
+
+    void setName(const char* name);
+    void setAging(unsigned long long ns);
+
+    void enqueue(const Task& task);
+    Task dequeue();
+
+    void enqueueBatch(const Task* tasks, int n);
+    int dequeueBatch(Task* out, int max);
+
+    bool evict(Task* task);
+
+    int size();
+};
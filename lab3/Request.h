@@ -1,7 +1,5 @@
 #pragma once
 
-#include <vector>
-
 #define INVENTORY_SIZE 100
 
 #define MAX_BUY_ITEM	    8
@@ -10,9 +8,51 @@
 #define MIN_BUDGET          5000
 #define MAX_PRICE	    1000000
 #define MAX_SHIPPING_COST   10000
+#define MAX_UPDATES         64
 
 // Forward declaration. Do not remove!!
 class EStore;
+class TaskQueue;
+
+/*
+ * ------------------------------------------------------------------
+ * ItemIdSet --
+ *
+ *      A set of at most MAX_BUY_ITEM item ids, kept sorted and
+ *      deduplicated in an inline array so that an order needs no
+ *      heap allocation. insert() returns false, and leaves the set
+ *      alone, if the id is already present or the set is full.
+ *
+ * ------------------------------------------------------------------
+ */
+class ItemIdSet {
+    private:
+    int ids[MAX_BUY_ITEM];
+    int count;
+
+    public:
+    ItemIdSet() : count(0) { }
+
+    bool insert(int id) {
+        int i = count;
+        while (i > 0 && ids[i - 1] > id)
+            i--;
+        if ((i > 0 && ids[i - 1] == id) || count == MAX_BUY_ITEM)
+            return false;
+        for (int j = count; j > i; j--)
+            ids[j] = ids[j - 1];
+        ids[i] = id;
+        count++;
+        return true;
+    }
+
+    void clear() { count = 0; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    int operator[](int i) const { return ids[i]; }
+    const int* begin() const { return ids; }
+    const int* end() const { return ids + count; }
+};
 
 enum SupplierRequestTypes {
     ADD_ITEM = 0,
@@ -88,11 +128,67 @@ struct BuyItemReq
     double budget;
 };
 
+/*
+ * A coarse-mode purchase parked with a continuation (see
+ * EStore::buyItemOrPark), to be handed back to queue as a new
+ * TASK_BUY_ITEM when it is resumed.
+ */
+struct ParkedBuyReq
+{
+    TaskQueue* queue;
+    BuyItemReq buy;
+};
+
 struct BuyManyItemsReq
 {
     EStore* store;
 
-    std::vector<int> item_ids;
+    ItemIdSet item_ids;
     double budget;
 };
 
+struct QuoteReq
+{
+    EStore* store;
+
+    int item_id;
+};
+
+struct QuoteManyReq
+{
+    EStore* store;
+
+    ItemIdSet item_ids;
+};
+
+/*
+ * What one entry of a supplier feed changes.
+ *
+ *      UPDATE_ADD_STOCK -- add count units of stock, as addStock.
+ *      UPDATE_PRICE     -- set the price to value, as priceItem.
+ *      UPDATE_DISCOUNT  -- set the discount to value, as
+ *                          discountItem.
+ */
+enum UpdateKind {
+    UPDATE_ADD_STOCK = 0,
+    UPDATE_PRICE,
+    UPDATE_DISCOUNT,
+    NUM_UPDATE_KINDS
+};
+
+struct Update
+{
+    UpdateKind kind;
+    int item_id;
+    int count;
+    double value;
+};
+
+struct ApplyUpdatesReq
+{
+    EStore* store;
+
+    int count;
+    Update updates[MAX_UPDATES];
+};
+
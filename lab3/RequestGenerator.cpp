@@ -1,41 +1,46 @@
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
-#include <set>
+#include <cmath>
+#include <cstring>
 
 #include "RequestHandlers.h"
+#include "RequestPool.h"
 #include "RequestGenerator.h"
 
 using namespace std;
 
+/*
+ * An item id drawn uniformly from the store's id space.
+ */
 static int
-rand_id()
+rand_id(EStore* store)
 {
-    return sutil_random() % INVENTORY_SIZE;
+    return sutil_rand() % store->idSpace();
 }
 
 static int
 rand_quantity()
 {
-    return (sutil_random() % MAX_QUANTITY) + 1;
+    return (sutil_rand() % MAX_QUANTITY) + 1;
 }
 
 static double
 rand_price(int max_price_cents)
 {
-    return (sutil_random() % max_price_cents) / 100.0;
+    return (sutil_rand() % max_price_cents) / 100.0;
 }
 
 static double
 rand_discount()
 {
-    return ((double) sutil_random() / RAND_MAX);
+    return ((double) sutil_rand() / RAND_MAX);
 }
 
 static int
 rand_request()
 {
-    return sutil_random() % NUM_SUPPLIER_REQUEST_TYPES;
+    return sutil_rand() % NUM_SUPPLIER_REQUEST_TYPES;
 }
 
 RequestGenerator::
@@ -49,15 +54,99 @@ RequestGenerator::
 {
 }
 
+/*
+ * Set the priority of a freshly generated task. By default a task
+ * gets the priority of its kind (see task_default_priority); a
+ * generator that knows better can override this.
+ */
 void RequestGenerator::
-enqueueTasks(int maxTasks, EStore* store)
+tagTask(Task& task)
+{
+    task.priority = task_default_priority(task.kind);
+}
+
+/*
+ * The time until the next request is due under an open-loop
+ * arrival process, in nanoseconds.
+ */
+unsigned long long RequestGenerator::
+nextInterval(const LoadProfile& load)
 {
+    double mean = 1e9 / load.rate;
+
+    if (load.arrivals != ARRIVAL_POISSON)
+        return (unsigned long long) mean;
+
+    // Inverse transform: -ln(1 - u) is exponential with mean 1.
+    double u = sutil_rand() / ((double) RAND_MAX + 1);
+    return (unsigned long long) (-log(1 - u) * mean);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueTasks --
+ *
+ *      Generate maxTasks requests (forever if maxTasks < 0) and
+ *      enqueue them at load.rate per second, following
+ *      load.arrivals. Requests are handed to the queue in bursts of
+ *      up to load.burst tasks with a single enqueueBatch call.
+ *
+ *      In the open-loop modes a burst holds only requests that are
+ *      already due, so bursts form only when the generator falls
+ *      behind its schedule (or, with ARRIVAL_AFAP, always).
+ *
+ *      Each task's enqueueNs is set to when it was scheduled to
+ *      arrive, or without a schedule to when it was enqueued.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+enqueueTasks(int maxTasks, EStore* store, const LoadProfile& load)
+{
+    Task batch[MAX_BURST];
+    bool open = load.arrivals != ARRIVAL_PACED;
+    bool afap = load.arrivals == ARRIVAL_AFAP;
+    unsigned long long due = sthread_now_ns();
+
+    assert(load.burst > 0 && load.burst <= MAX_BURST);
+    assert(afap || load.rate > 0);
     taskCount = 0;
     while (taskCount < maxTasks || maxTasks < 0)
     {
-        taskQueue->enqueue(generateTask(store));
-        taskCount++;
-        sthread_sleep(0, 100000000);
+        if (open && !afap)
+            sthread_sleep_until(due);
+
+        int n = 0;
+        do
+        {
+            batch[n] = generateTask(store);
+            tagTask(batch[n]);
+            batch[n++].enqueueNs = due;
+            taskCount++;
+            if (open && !afap)
+                due += nextInterval(load);
+        } while (n < load.burst && (taskCount < maxTasks || maxTasks < 0)
+                 && (afap || (open && due <= sthread_now_ns())));
+
+        // A scheduled task's queueing delay runs from when it was due,
+        // so a generator held up by a full queue still shows up.
+        if (!open || afap)
+        {
+            due = sthread_now_ns();
+            for (int i = 0; i < n; i++)
+                batch[i].enqueueNs = due;
+        }
+        taskQueue->enqueueBatch(batch, n);
+
+        if (!open)
+        {
+            unsigned long long delay =
+                (unsigned long long) (n * 1e9 / load.rate);
+            sthread_sleep(delay / 1000000000ULL, delay % 1000000000ULL);
+        }
     }
 }
 
@@ -80,13 +169,50 @@ enqueueTasks(int maxTasks, EStore* store)
 void RequestGenerator::
 enqueueStops(int num)
 {
-    // TODO: Your code here.
+    Task stop;
+    stop.kind = TASK_STOP;
+    stop.priority = task_default_priority(TASK_STOP);
+
+    for (int i = 0; i < num; i++)
+        taskQueue->enqueue(stop);
 }
 
 SupplierRequestGenerator::
-SupplierRequestGenerator(TaskQueue* queue)
-    : RequestGenerator(queue)
-{ }
+SupplierRequestGenerator(TaskQueue* queue, int feedSize)
+    : RequestGenerator(queue), updateBatch(feedSize)
+{
+    assert(feedSize >= 0 && feedSize <= MAX_UPDATES);
+}
+
+/*
+ * A feed of updateBatch random stock, price and discount updates,
+ * drawn like the single requests they stand in for.
+ */
+Task SupplierRequestGenerator::
+generateFeed(EStore* store)
+{
+    Task task;
+    ApplyUpdatesReq* req = pool_new<ApplyUpdatesReq>();
+
+    req->store = store;
+    req->count = updateBatch;
+    for (int i = 0; i < updateBatch; i++)
+    {
+        Update& update = req->updates[i];
+        update.kind = (UpdateKind) (sutil_rand() % NUM_UPDATE_KINDS);
+        update.item_id = rand_id(store);
+        if (update.kind == UPDATE_ADD_STOCK)
+            update.count = rand_quantity();
+        else if (update.kind == UPDATE_PRICE)
+            update.value = rand_price(MAX_PRICE);
+        else
+            update.value = rand_discount();
+    }
+
+    task.kind = TASK_APPLY_UPDATES;
+    task.arg = req;
+    return task;
+}
 
 Task SupplierRequestGenerator::
 generateTask(EStore* store)
@@ -102,81 +228,73 @@ generateTask(EStore* store)
     else
         request_type = rand_request();
 
+    if (updateBatch > 0
+        && (request_type == ADD_STOCK || request_type == CHANGE_ITEM_PRICE
+            || request_type == CHANGE_ITEM_DISCOUNT))
+        return generateFeed(store);
+
     switch(request_type)
     {
         case ADD_ITEM:
         {
-            AddItemReq* req = new AddItemReq();
-            req->store = store;
-            req->item_id   = rand_id();
-            req->price     = rand_price(MAX_PRICE) + 1;
-            req->quantity  = rand_quantity();
-
-            task.handler = add_item_handler;
-            task.arg = req;
+            task.kind = TASK_ADD_ITEM;
+            AddItemReq& req = task.addItem;
+            req.store = store;
+            req.item_id   = rand_id(store);
+            req.price     = rand_price(MAX_PRICE) + 1;
+            req.quantity  = rand_quantity();
+            req.discount  = 0;
             break;
         }
         case REMOVE_ITEM:
         {
-            RemoveItemReq* req = new RemoveItemReq();
-            req->store = store;
-            req->item_id   = rand_id();
-
-            task.handler = remove_item_handler;
-            task.arg = req;
+            task.kind = TASK_REMOVE_ITEM;
+            RemoveItemReq& req = task.removeItem;
+            req.store = store;
+            req.item_id   = rand_id(store);
             break;
         }
         case ADD_STOCK:
         {
-            AddStockReq* req = new AddStockReq();
-            req->store        = store;
-            req->item_id          = rand_id();
-            req->additional_stock = rand_quantity();
-
-            task.handler = add_stock_handler;
-            task.arg = req;
+            task.kind = TASK_ADD_STOCK;
+            AddStockReq& req = task.addStock;
+            req.store        = store;
+            req.item_id          = rand_id(store);
+            req.additional_stock = rand_quantity();
             break;
         }
         case CHANGE_ITEM_PRICE:
         {
-            ChangeItemPriceReq* req = new ChangeItemPriceReq();
-            req->store = store;
-            req->item_id    = rand_id();
-            req->new_price  = rand_price(MAX_PRICE);
-
-            task.handler = change_item_price_handler;
-            task.arg = req;
+            task.kind = TASK_CHANGE_ITEM_PRICE;
+            ChangeItemPriceReq& req = task.changeItemPrice;
+            req.store = store;
+            req.item_id    = rand_id(store);
+            req.new_price  = rand_price(MAX_PRICE);
             break;
         }
         case CHANGE_ITEM_DISCOUNT:
         {
-            ChangeItemDiscountReq* req = new ChangeItemDiscountReq();
-            req->store = store;
-            req->item_id       = rand_id();
-            req->new_discount  = rand_discount();
-
-            task.handler = change_item_discount_handler;
-            task.arg = req;
+            task.kind = TASK_CHANGE_ITEM_DISCOUNT;
+            ChangeItemDiscountReq& req = task.changeItemDiscount;
+            req.store = store;
+            req.item_id       = rand_id(store);
+            req.new_discount  = rand_discount();
             break;
         }
         case SET_SHIPPING_COST:
         {
-            SetShippingCostReq* req = new SetShippingCostReq();
-            req->store = store;
-            req->new_cost  = rand_price(MAX_SHIPPING_COST);
-
-            task.handler = set_shipping_cost_handler;
-            task.arg = req;
+            task.kind = TASK_SET_SHIPPING_COST;
+            SetShippingCostReq& req = task.setShippingCost;
+            req.store = store;
+            req.new_cost  = rand_price(MAX_SHIPPING_COST);
             break;
         }
         case SET_STORE_DISCOUNT:
         {
-            SetStoreDiscountReq* req = new SetStoreDiscountReq();
-            req->store    = store;
-            req->new_discount = rand_discount();
-
-            task.handler = set_store_discount_handler;
-            task.arg = req;
+            task.kind = TASK_SET_STORE_DISCOUNT;
+            SetStoreDiscountReq& req = task.setStoreDiscount;
+            req.store    = store;
+            req.new_discount = rand_discount();
             break;
         }
         default:
@@ -191,42 +309,99 @@ generateTask(EStore* store)
 }
 
 CustomerRequestGenerator::
-CustomerRequestGenerator(TaskQueue* queue, bool inFineMode)
-    : RequestGenerator(queue), fineMode(inFineMode)
-{ }
+CustomerRequestGenerator(TaskQueue* queue, bool inFineMode, int quotePercent)
+    : RequestGenerator(queue), fineMode(inFineMode), quoteMix(quotePercent)
+{
+    assert(quotePercent >= 0 && quotePercent <= 100);
+}
 
+/*
+ * A price check shaped like the purchase it stands in for.
+ */
 Task CustomerRequestGenerator::
-generateTask(EStore* store)
+generateQuote(EStore* store)
 {
     Task task;
 
     if (!fineMode)
     {
-        BuyItemReq* req = new BuyItemReq();
+        task.kind = TASK_QUOTE;
+        QuoteReq& req = task.quote;
+        req.store = store;
+        req.item_id = rand_id(store);
+    }
+    else
+    {
+        QuoteManyReq* req = pool_new<QuoteManyReq>();
+
+        int num_items = (sutil_rand() % MAX_BUY_ITEM) + 1;
+
         req->store = store;
-        req->item_id   = rand_id();
-        req->budget    = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        for (int i = 0; i < num_items; i++)
+            req->item_ids.insert(rand_id(store));
 
-        task.handler = buy_item_handler;
+        task.kind = TASK_QUOTE_MANY;
         task.arg = req;
     }
+    return task;
+}
+
+Task CustomerRequestGenerator::
+generateTask(EStore* store)
+{
+    Task task;
+
+    if (quoteMix > 0 && sutil_rand() % 100 < quoteMix)
+        return generateQuote(store);
+
+    if (!fineMode)
+    {
+        task.kind = TASK_BUY_ITEM;
+        BuyItemReq& req = task.buyItem;
+        req.store = store;
+        req.item_id   = rand_id(store);
+        req.budget    = rand_price(MAX_BUDGET) + MIN_BUDGET;
+    }
     else
     {
-        BuyManyItemsReq* req = new BuyManyItemsReq();
+        BuyManyItemsReq* req = pool_new<BuyManyItemsReq>();
 
-        int num_buy_item = (sutil_random() % MAX_BUY_ITEM) + 1;
-
-        set<int> order;
-        for(int i = 0; i < num_buy_item; i++)
-            order.insert(rand_id());
+        int num_buy_item = (sutil_rand() % MAX_BUY_ITEM) + 1;
 
         req->store = store;
-        req->item_ids.insert(req->item_ids.begin(), order.begin(), order.end());
+        for(int i = 0; i < num_buy_item; i++)
+            req->item_ids.insert(rand_id(store));
         req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;;
 
-        task.handler = buy_many_items_handler;
+        task.kind = TASK_BUY_MANY_ITEMS;
         task.arg = req;
     }
     return task;
 }
 
+static const char* arrivalNames[NUM_ARRIVAL_PROCESSES] = {
+    "paced",
+    "constant",
+    "poisson",
+    "afap",
+};
+
+const char*
+arrival_process_name(ArrivalProcess arrivals)
+{
+    return arrivalNames[arrivals];
+}
+
+bool
+arrival_process_parse(const char* name, ArrivalProcess* arrivals)
+{
+    for (int i = 0; i < NUM_ARRIVAL_PROCESSES; i++)
+    {
+        if (strcmp(name, arrivalNames[i]) == 0)
+        {
+            *arrivals = (ArrivalProcess) i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -4,6 +4,47 @@
 #include "TaskQueue.h"
 #include "Request.h"
 
+// Largest burst enqueueTasks will hand to the queue in one call.
+#define MAX_BURST 64
+
+/*
+ * When a generator produces its requests.
+ *
+ *      ARRIVAL_PACED    -- closed loop: after each burst, sleep for
+ *                          as long as the burst should take at the
+ *                          target rate. Time spent generating and
+ *                          enqueueing is added on top, so the real
+ *                          rate falls below the target.
+ *      ARRIVAL_CONSTANT -- open loop: requests are due at fixed
+ *                          intervals on an absolute schedule, and a
+ *                          late generator catches up.
+ *      ARRIVAL_POISSON  -- open loop: as ARRIVAL_CONSTANT but with
+ *                          exponentially distributed intervals.
+ *      ARRIVAL_AFAP     -- no schedule: enqueue as fast as possible,
+ *                          limited only by the queue.
+ */
+enum ArrivalProcess {
+    ARRIVAL_PACED = 0,
+    ARRIVAL_CONSTANT,
+    ARRIVAL_POISSON,
+    ARRIVAL_AFAP,
+    NUM_ARRIVAL_PROCESSES
+};
+
+/*
+ * How one generator thread offers load: its arrival process, target
+ * rate in requests per second, and the most requests it hands to the
+ * queue in one call. The default is the original 10 requests/s, one
+ * at a time.
+ */
+struct LoadProfile {
+    ArrivalProcess arrivals;
+    double rate;
+    int burst;
+
+    LoadProfile() : arrivals(ARRIVAL_PACED), rate(10), burst(1) { }
+};
+
 class RequestGenerator {
     private:
     TaskQueue* taskQueue;
@@ -12,31 +53,57 @@ class RequestGenerator {
     int taskCount;
 
     virtual Task generateTask(EStore* store) = 0;
+    virtual void tagTask(Task& task);
+
+    unsigned long long nextInterval(const LoadProfile& load);
 
     public:
     RequestGenerator(TaskQueue* queue);
     ~RequestGenerator();
 
-    void enqueueTasks(int maxTasks, EStore* store);
+    void enqueueTasks(int maxTasks, EStore* store,
+                      const LoadProfile& load = LoadProfile());
     void enqueueStops(int num);
 };
 
+/*
+ * Generates supplier requests. With an updateBatch of N > 0, every
+ * stock, price or discount change it would have generated becomes
+ * instead one TASK_APPLY_UPDATES feed of N such changes.
+ */
 class SupplierRequestGenerator : public RequestGenerator {
+    private:
+    int updateBatch;
+
+    Task generateFeed(EStore* store);
+
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    SupplierRequestGenerator(TaskQueue* queue);
+    SupplierRequestGenerator(TaskQueue* queue, int feedSize = 0);
 };
 
+/*
+ * Generates customer requests: buyItem calls in coarse mode,
+ * buyManyItems in fine mode. quotePercent percent of the requests
+ * are instead price checks for the same kind of purchase (quote or
+ * quoteMany).
+ */
 class CustomerRequestGenerator : public RequestGenerator {
     private:
     bool fineMode;
+    int quoteMix;
+
+    Task generateQuote(EStore* store);
 
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode);
+    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode,
+                             int quotePercent = 0);
 };
 
+const char* arrival_process_name(ArrivalProcess arrivals);
+bool arrival_process_parse(const char* name, ArrivalProcess* arrivals);
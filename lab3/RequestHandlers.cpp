@@ -1,11 +1,18 @@
 
+#include "EStore.h"
+#include "LatencyStats.h"
+#include "Request.h"
+#include "RequestHandlers.h"
+#include "RequestPool.h"
+#include "sthread.h"
+
 /*
  * ------------------------------------------------------------------
  * add_item_handler --
  *
  *      Handle an AddItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -15,7 +22,10 @@
 void 
 add_item_handler(void *args)
 {
-    // TODO: Your code here.
+    AddItemReq* req = (AddItemReq*) args;
+
+    req->store->addItem(req->item_id, req->quantity, req->price, req->discount);
+    pool_delete(req);
 }
 
 /*
@@ -24,7 +34,7 @@ add_item_handler(void *args)
  *
  *      Handle a RemoveItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -34,7 +44,10 @@ add_item_handler(void *args)
 void 
 remove_item_handler(void *args)
 {
-    // TODO: Your code here.
+    RemoveItemReq* req = (RemoveItemReq*) args;
+
+    req->store->removeItem(req->item_id);
+    pool_delete(req);
 }
 
 /*
@@ -43,7 +56,7 @@ remove_item_handler(void *args)
  *
  *      Handle an AddStockReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -53,7 +66,10 @@ remove_item_handler(void *args)
 void 
 add_stock_handler(void *args)
 {
-    // TODO: Your code here.
+    AddStockReq* req = (AddStockReq*) args;
+
+    req->store->addStock(req->item_id, req->additional_stock);
+    pool_delete(req);
 }
 
 /*
@@ -62,7 +78,7 @@ add_stock_handler(void *args)
  *
  *      Handle a ChangeItemPriceReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -72,7 +88,10 @@ add_stock_handler(void *args)
 void 
 change_item_price_handler(void *args)
 {
-    // TODO: Your code here.
+    ChangeItemPriceReq* req = (ChangeItemPriceReq*) args;
+
+    req->store->priceItem(req->item_id, req->new_price);
+    pool_delete(req);
 }
 
 /*
@@ -81,7 +100,7 @@ change_item_price_handler(void *args)
  *
  *      Handle a ChangeItemDiscountReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -91,7 +110,10 @@ change_item_price_handler(void *args)
 void 
 change_item_discount_handler(void *args)
 {
-    // TODO: Your code here.
+    ChangeItemDiscountReq* req = (ChangeItemDiscountReq*) args;
+
+    req->store->discountItem(req->item_id, req->new_discount);
+    pool_delete(req);
 }
 
 /*
@@ -100,7 +122,7 @@ change_item_discount_handler(void *args)
  *
  *      Handle a SetShippingCostReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -110,7 +132,10 @@ change_item_discount_handler(void *args)
 void 
 set_shipping_cost_handler(void *args)
 {
-    // TODO: Your code here.
+    SetShippingCostReq* req = (SetShippingCostReq*) args;
+
+    req->store->setShippingCost(req->new_cost);
+    pool_delete(req);
 }
 
 /*
@@ -119,7 +144,7 @@ set_shipping_cost_handler(void *args)
  *
  *      Handle a SetStoreDiscountReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -129,7 +154,32 @@ set_shipping_cost_handler(void *args)
 void
 set_store_discount_handler(void *args)
 {
-    // TODO: Your code here.
+    SetStoreDiscountReq* req = (SetStoreDiscountReq*) args;
+
+    req->store->setStoreDiscount(req->new_discount);
+    pool_delete(req);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * apply_updates_handler --
+ *
+ *      Handle an ApplyUpdatesReq.
+ *
+ *      Return the request object to its pool when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+apply_updates_handler(void *args)
+{
+    ApplyUpdatesReq* req = (ApplyUpdatesReq*) args;
+
+    req->store->applyUpdates(req->updates, req->count);
+    pool_delete(req);
 }
 
 /*
@@ -138,7 +188,7 @@ set_store_discount_handler(void *args)
  *
  *      Handle a BuyItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -148,7 +198,10 @@ set_store_discount_handler(void *args)
 void
 buy_item_handler(void *args)
 {
-    // TODO: Your code here.
+    BuyItemReq* req = (BuyItemReq*) args;
+
+    req->store->buyItem(req->item_id, req->budget);
+    pool_delete(req);
 }
 
 /*
@@ -157,7 +210,7 @@ buy_item_handler(void *args)
  *
  *      Handle a BuyManyItemsReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -167,7 +220,57 @@ buy_item_handler(void *args)
 void
 buy_many_items_handler(void *args)
 {
-    // TODO: Your code here.
+    BuyManyItemsReq* req = (BuyManyItemsReq*) args;
+
+    req->store->buyManyItems(req->item_ids, req->budget);
+    pool_delete(req);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quote_handler --
+ *
+ *      Handle a QuoteReq. The quote itself is dropped: the request
+ *      stands for a storefront price check.
+ *
+ *      Return the request object to its pool when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+quote_handler(void *args)
+{
+    QuoteReq* req = (QuoteReq*) args;
+    double cost;
+
+    req->store->quote(req->item_id, &cost);
+    pool_delete(req);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * quote_many_handler --
+ *
+ *      Handle a QuoteManyReq, like quote_handler.
+ *
+ *      Return the request object to its pool when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+quote_many_handler(void *args)
+{
+    QuoteManyReq* req = (QuoteManyReq*) args;
+    double total;
+
+    req->store->quoteMany(req->item_ids, &total);
+    pool_delete(req);
 }
 
 /*
@@ -184,6 +287,130 @@ buy_many_items_handler(void *args)
 void 
 stop_handler(void* args)
 {
-    // TODO: Your code here.
+    sthread_exit();
 }
 
+/*
+ * ------------------------------------------------------------------
+ * handle_task --
+ *
+ *      Run a dequeued Task, recording its queueing delay (enqueueNs
+ *      to dequeueNs, if both were stamped) and the time from handler
+ *      start to end in the calling thread's latency histograms.
+ *      parkQueue is as for run_task.
+ *
+ * Results:
+ *      None. A stop task does not return and is not recorded.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+handle_task(Task& task, TaskQueue* parkQueue)
+{
+    TaskKind kind = task.kind;
+
+    if (task_is_stop(task))
+        run_task(task, parkQueue);
+
+    if (task.enqueueNs != 0 && task.dequeueNs >= task.enqueueNs)
+        latency_record(kind, LATENCY_QUEUE, task.dequeueNs - task.enqueueNs);
+
+    unsigned long long start = sthread_now_ns();
+    run_task(task, parkQueue);
+    latency_record(kind, LATENCY_SERVICE, sthread_now_ns() - start);
+}
+
+/*
+ * The continuation of a parked purchase: hand it back to its queue
+ * as a fresh TASK_BUY_ITEM. It was admitted once already, so it goes
+ * past the queue's limits, and its queueing delay starts now. This
+ * may run on a worker of that very queue, which is why it requeues:
+ * requeueBatch never blocks, even on a full ring.
+ */
+static void
+resume_buy(void* context)
+{
+    ParkedBuyReq* parked = (ParkedBuyReq*) context;
+    Task retry;
+
+    retry.kind = TASK_BUY_ITEM;
+    retry.priority = task_default_priority(TASK_BUY_ITEM);
+    retry.buyItem = parked->buy;
+    retry.enqueueNs = sthread_now_ns();
+    parked->queue->requeueBatch(&retry, 1);
+    pool_delete(parked);
+}
+
+/*
+ * Make the continuation of a purchase that has to wait: copy the
+ * caller's request to the pool, as it must outlive the call.
+ */
+static Continuation
+park_buy(void* arg)
+{
+    ParkedBuyReq* parked = pool_new<ParkedBuyReq>();
+    *parked = *(const ParkedBuyReq*) arg;
+
+    Continuation k = { resume_buy, parked };
+    return k;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_item_or_park --
+ *
+ *      Run a coarse-mode buyItem request without blocking the
+ *      calling worker. If the purchase cannot go through yet, it
+ *      is parked on the item (see EStore::buyItemOrPark), and the
+ *      supplier operation that may let it through hands it back to
+ *      queue to be tried again.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_item_or_park(const BuyItemReq& req, TaskQueue* queue)
+{
+    ParkedBuyReq pending;
+    pending.queue = queue;
+    pending.buy = req;
+
+    req.store->buyItemOrPark(req.item_id, req.budget, park_buy, &pending);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * discard_task --
+ *
+ *      Release a Task that will never run, such as one a bounded
+ *      TaskQueue refused or dropped (see TaskQueue::setDiscardHook):
+ *      return its pooled request, if it has one, to the pool.
+ *
+ *      The arg of a TASK_CUSTOM task is owned by its handler and is
+ *      left alone.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+discard_task(const Task& task)
+{
+    switch (task.kind)
+    {
+        case TASK_BUY_MANY_ITEMS:
+            pool_delete((BuyManyItemsReq*) task.arg);
+            break;
+        case TASK_QUOTE_MANY:
+            pool_delete((QuoteManyReq*) task.arg);
+            break;
+        case TASK_APPLY_UPDATES:
+            pool_delete((ApplyUpdatesReq*) task.arg);
+            break;
+        default:
+            break;
+    }
+}
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <cstdlib>
+
+#include "EStore.h"
+#include "RequestPool.h"
+#include "TaskQueue.h"
+
 void add_item_handler(void *args);
 void remove_item_handler(void *args);
 void add_stock_handler(void *args);
@@ -7,8 +13,137 @@ void change_item_price_handler(void *args);
 void change_item_discount_handler(void *args);
 void set_shipping_cost_handler(void *args);
 void set_store_discount_handler(void *args);
+void apply_updates_handler(void *args);
 
 void buy_item_handler(void *args);
 void buy_many_items_handler(void *args);
+void quote_handler(void *args);
+void quote_many_handler(void *args);
 
 void stop_handler(void *args);
+
+void handle_task(Task& task, TaskQueue* parkQueue = NULL);
+void buy_item_or_park(const BuyItemReq& req, TaskQueue* queue);
+void discard_task(const Task& task);
+
+/*
+ * True if running the task ends the calling worker thread.
+ */
+static inline bool
+task_is_stop(const Task& task)
+{
+    return task.kind == TASK_STOP
+        || (task.kind == TASK_CUSTOM && task.handler == stop_handler);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * run_task --
+ *
+ *      Run one Task. Store requests carried inline in the Task are
+ *      dispatched by a switch on its kind, straight to the EStore
+ *      method, with nothing to allocate or free; a TASK_CUSTOM task
+ *      calls its handler. Defined here so that workers can inline
+ *      the dispatch.
+ *
+ *      With a parkQueue, a buyItem that cannot go through yet is
+ *      parked instead of blocking the worker, and handed back to
+ *      parkQueue once it may (see buy_item_or_park).
+ *
+ * Results:
+ *      None. A TASK_STOP task does not return.
+ *
+ * ------------------------------------------------------------------
+ */
+static inline void
+run_task(Task& task, TaskQueue* parkQueue = NULL)
+{
+    switch (task.kind)
+    {
+        case TASK_CUSTOM:
+            task.handler(task.arg);
+            break;
+        case TASK_ADD_ITEM:
+        {
+            AddItemReq& req = task.addItem;
+            req.store->addItem(req.item_id, req.quantity, req.price,
+                               req.discount);
+            break;
+        }
+        case TASK_REMOVE_ITEM:
+            task.removeItem.store->removeItem(task.removeItem.item_id);
+            break;
+        case TASK_ADD_STOCK:
+        {
+            AddStockReq& req = task.addStock;
+            req.store->addStock(req.item_id, req.additional_stock);
+            break;
+        }
+        case TASK_CHANGE_ITEM_PRICE:
+        {
+            ChangeItemPriceReq& req = task.changeItemPrice;
+            req.store->priceItem(req.item_id, req.new_price);
+            break;
+        }
+        case TASK_CHANGE_ITEM_DISCOUNT:
+        {
+            ChangeItemDiscountReq& req = task.changeItemDiscount;
+            req.store->discountItem(req.item_id, req.new_discount);
+            break;
+        }
+        case TASK_SET_SHIPPING_COST:
+        {
+            SetShippingCostReq& req = task.setShippingCost;
+            req.store->setShippingCost(req.new_cost);
+            break;
+        }
+        case TASK_SET_STORE_DISCOUNT:
+        {
+            SetStoreDiscountReq& req = task.setStoreDiscount;
+            req.store->setStoreDiscount(req.new_discount);
+            break;
+        }
+        case TASK_BUY_ITEM:
+        {
+            BuyItemReq& req = task.buyItem;
+            if (parkQueue)
+                buy_item_or_park(req, parkQueue);
+            else
+                req.store->buyItem(req.item_id, req.budget);
+            break;
+        }
+        case TASK_BUY_MANY_ITEMS:
+        {
+            BuyManyItemsReq* req = (BuyManyItemsReq*) task.arg;
+            req->store->buyManyItems(req->item_ids, req->budget);
+            pool_delete(req);
+            break;
+        }
+        case TASK_QUOTE:
+        {
+            double cost;
+            task.quote.store->quote(task.quote.item_id, &cost);
+            break;
+        }
+        case TASK_QUOTE_MANY:
+        {
+            QuoteManyReq* req = (QuoteManyReq*) task.arg;
+            double total;
+            req->store->quoteMany(req->item_ids, &total);
+            pool_delete(req);
+            break;
+        }
+        case TASK_APPLY_UPDATES:
+        {
+            ApplyUpdatesReq* req = (ApplyUpdatesReq*) task.arg;
+            req->store->applyUpdates(req->updates, req->count);
+            pool_delete(req);
+            break;
+        }
+        case TASK_STOP:
+            sthread_exit();
+            break;
+        default:
+            abort();
+    }
+}
@@ -0,0 +1,40 @@
+#include "Request.h"
+#include "RequestPool.h"
+
+template <typename T>
+static void
+report(FILE* out, const char* name)
+{
+    PoolStats s = RequestPool<T>::stats();
+    fprintf(out, "%-24s live %6ld  pooled %6ld\n", name, s.live, s.pooled);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * request_pool_report --
+ *
+ *      Print the live and pooled object counts of every request
+ *      pool.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+request_pool_report(FILE* out)
+{
+    report<AddItemReq>(out, "AddItemReq");
+    report<RemoveItemReq>(out, "RemoveItemReq");
+    report<AddStockReq>(out, "AddStockReq");
+    report<ChangeItemPriceReq>(out, "ChangeItemPriceReq");
+    report<ChangeItemDiscountReq>(out, "ChangeItemDiscountReq");
+    report<SetShippingCostReq>(out, "SetShippingCostReq");
+    report<SetStoreDiscountReq>(out, "SetStoreDiscountReq");
+    report<ApplyUpdatesReq>(out, "ApplyUpdatesReq");
+    report<BuyItemReq>(out, "BuyItemReq");
+    report<ParkedBuyReq>(out, "ParkedBuyReq");
+    report<BuyManyItemsReq>(out, "BuyManyItemsReq");
+    report<QuoteReq>(out, "QuoteReq");
+    report<QuoteManyReq>(out, "QuoteManyReq");
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdio>
+#include <new>
+
+#include "sthread.h"
+
+// Objects moved between a thread's cache and the home pool at once.
+#define POOL_BATCH 32
+
+// Objects carved out of each slab the home pool allocates.
+#define POOL_SLAB 128
+
+struct PoolStats {
+    long live;      // handed out and not yet released
+    long pooled;    // free, in the home pool or a thread cache
+};
+
+/*
+ * ------------------------------------------------------------------
+ * RequestPool --
+ *
+ *      A typed object pool for request structs. Generators allocate
+ *      requests on one thread and handlers release them on another,
+ *      so each thread keeps a small cache of free objects and only
+ *      touches the shared home pool (under its lock) to move a
+ *      batch of POOL_BATCH objects in or out. The home pool grows a
+ *      slab at a time and never returns memory.
+ *
+ *      alloc() returns a value-initialized T, like "new T()", and
+ *      release() destroys it, like "delete". The live/pooled counts
+ *      are folded into the home pool whenever a thread moves a
+ *      batch or exits, so stats() may lag by up to a batch per
+ *      running thread.
+ *
+ * ------------------------------------------------------------------
+ */
+template <typename T>
+class RequestPool {
+    private:
+    union Node {
+        Node* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Home {
+        smutex_t lock;
+        Node* free;
+        long created;
+        long live;
+
+        Home() : free(NULL), created(0), live(0) {
+            smutex_init(&lock);
+            smutex_set_name(&lock, "RequestPool");
+        }
+    };
+
+    struct Cache {
+        Node* free;
+        int count;
+        long liveDelta;
+
+        Cache() : free(NULL), count(0), liveDelta(0) { }
+        ~Cache() { spill(*this, count); }
+    };
+
+    // Never destroyed, so threads still running at exit stay safe.
+    static Home& home() {
+        static Home* h = new Home();
+        return *h;
+    }
+
+    static Cache& cache() {
+        static thread_local Cache c;
+        return c;
+    }
+
+    static void refill(Cache& c);
+    static void spill(Cache& c, int n);
+
+    public:
+    static T* alloc();
+    static void release(T* obj);
+    static PoolStats stats();
+};
+
+/*
+ * Move up to POOL_BATCH free objects from the home pool into the
+ * thread's cache, carving a new slab first if the pool is empty.
+ */
+template <typename T>
+void RequestPool<T>::
+refill(Cache& c)
+{
+    Home& h = home();
+
+    smutex_lock(&h.lock);
+    if (h.free == NULL)
+    {
+        Node* slab = new Node[POOL_SLAB];
+        for (int i = 0; i < POOL_SLAB - 1; i++)
+            slab[i].next = &slab[i + 1];
+        slab[POOL_SLAB - 1].next = NULL;
+        h.free = slab;
+        h.created += POOL_SLAB;
+    }
+
+    Node* first = h.free;
+    Node* last = first;
+    int n = 1;
+    while (n < POOL_BATCH && last->next != NULL)
+    {
+        last = last->next;
+        n++;
+    }
+    h.free = last->next;
+    h.live += c.liveDelta;
+    smutex_unlock(&h.lock);
+
+    last->next = c.free;
+    c.free = first;
+    c.count += n;
+    c.liveDelta = 0;
+}
+
+/*
+ * Return n objects from the thread's cache to the home pool as one
+ * chain, and fold in the thread's live count.
+ */
+template <typename T>
+void RequestPool<T>::
+spill(Cache& c, int n)
+{
+    Node* first = NULL;
+    Node* last = NULL;
+    if (n > 0)
+    {
+        first = c.free;
+        last = first;
+        for (int i = 1; i < n; i++)
+            last = last->next;
+        c.free = last->next;
+        c.count -= n;
+    }
+
+    Home& h = home();
+    smutex_lock(&h.lock);
+    if (n > 0)
+    {
+        last->next = h.free;
+        h.free = first;
+    }
+    h.live += c.liveDelta;
+    smutex_unlock(&h.lock);
+    c.liveDelta = 0;
+}
+
+template <typename T>
+T* RequestPool<T>::
+alloc()
+{
+    Cache& c = cache();
+    if (c.free == NULL)
+        refill(c);
+
+    Node* node = c.free;
+    c.free = node->next;
+    c.count--;
+    c.liveDelta++;
+    return new (node->storage) T();
+}
+
+template <typename T>
+void RequestPool<T>::
+release(T* obj)
+{
+    if (obj == NULL)
+        return;
+    obj->~T();
+
+    Cache& c = cache();
+    Node* node = reinterpret_cast<Node*>(obj);
+    node->next = c.free;
+    c.free = node;
+    c.count++;
+    c.liveDelta--;
+    if (c.count >= 2 * POOL_BATCH)
+        spill(c, POOL_BATCH);
+}
+
+template <typename T>
+PoolStats RequestPool<T>::
+stats()
+{
+    Home& h = home();
+    PoolStats s;
+
+    smutex_lock(&h.lock);
+    s.live = h.live;
+    s.pooled = h.created - h.live;
+    smutex_unlock(&h.lock);
+    return s;
+}
+
+template <typename T>
+T* pool_new()
+{
+    return RequestPool<T>::alloc();
+}
+
+template <typename T>
+void pool_delete(T* obj)
+{
+    RequestPool<T>::release(obj);
+}
+
+void request_pool_report(FILE* out);
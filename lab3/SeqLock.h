@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+
+#include "sthread.h"
+
+/*
+ * ------------------------------------------------------------------
+ * SeqCount --
+ *
+ *      The sequence number of a SeqLock on its own, for data whose
+ *      writers already serialize on some other lock. Each writer
+ *      brackets its update with writeBegin() and writeEnd(); readers
+ *      use readBegin() and readRetry() exactly as with a SeqLock.
+ *
+ * ------------------------------------------------------------------
+ */
+class SeqCount {
+    private:
+    std::atomic<unsigned long> seq;
+
+    public:
+    SeqCount() : seq(0) { }
+
+    unsigned long readBegin() const {
+        unsigned long start;
+        while ((start = seq.load(std::memory_order_acquire)) & 1)
+            sthread_relax();
+        return start;
+    }
+
+    bool readRetry(unsigned long start) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) != start;
+    }
+
+    void writeBegin() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void writeEnd() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+    }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SeqLock --
+ *
+ *      A sequence lock for small, rarely written, often read data.
+ *      Writers serialize on a mutex and bump the sequence number to
+ *      odd before and to even after the update. Readers never write
+ *      shared memory: they read the sequence, read the data, and
+ *      retry if the sequence was odd or moved.
+ *
+ *      The protected fields must be std::atomic and accessed with
+ *      memory_order_relaxed; the sequence supplies the ordering.
+ *
+ *          unsigned long v;
+ *          do {
+ *              v = lock.readBegin();
+ *              ... relaxed loads ...
+ *          } while (lock.readRetry(v));
+ *
+ * ------------------------------------------------------------------
+ */
+class SeqLock {
+    private:
+    SeqCount count;
+    smutex_t writer;
+
+    public:
+    SeqLock() {
+        smutex_init(&writer);
+        smutex_set_name(&writer, "SeqLock.writer");
+    }
+    ~SeqLock() { smutex_destroy(&writer); }
+
+    unsigned long readBegin() const { return count.readBegin(); }
+    bool readRetry(unsigned long start) const {
+        return count.readRetry(start);
+    }
+
+    void writeLock() {
+        smutex_lock(&writer);
+        count.writeBegin();
+    }
+
+    void writeUnlock() {
+        count.writeEnd();
+        smutex_unlock(&writer);
+    }
+};
@@ -1,16 +1,191 @@
+#include <cstring>
 
+#include "PriorityLanes.h"
 #include "TaskQueue.h"
+#include "TaskRing.h"
+#include "WorkStealing.h"
+
+static const char* backendNames[NUM_TASKQUEUE_BACKENDS] = {
+    "monitor",
+    "ring",
+    "steal",
+    "priority",
+};
+
+static const char* overflowNames[NUM_OVERFLOW_POLICIES] = {
+    "block",
+    "reject",
+    "drop-oldest",
+};
+
+static const char* taskKindNames[NUM_TASK_KINDS] = {
+    "custom",
+    "add_item",
+    "remove_item",
+    "add_stock",
+    "change_item_price",
+    "change_item_discount",
+    "set_shipping_cost",
+    "set_store_discount",
+    "buy_item",
+    "buy_many_items",
+    "quote",
+    "quote_many",
+    "apply_updates",
+    "stop",
+};
+
+static const TaskPriority taskKindPriorities[NUM_TASK_KINDS] = {
+    PRIORITY_NORMAL,    // custom
+    PRIORITY_URGENT,    // add_item
+    PRIORITY_NORMAL,    // remove_item
+    PRIORITY_URGENT,    // add_stock
+    PRIORITY_URGENT,    // change_item_price
+    PRIORITY_URGENT,    // change_item_discount
+    PRIORITY_URGENT,    // set_shipping_cost
+    PRIORITY_URGENT,    // set_store_discount
+    PRIORITY_NORMAL,    // buy_item
+    PRIORITY_NORMAL,    // buy_many_items
+    PRIORITY_NORMAL,    // quote
+    PRIORITY_NORMAL,    // quote_many
+    PRIORITY_BULK,      // apply_updates
+    PRIORITY_BULK,      // stop
+};
+
+const char*
+task_kind_name(TaskKind kind)
+{
+    return taskKindNames[kind];
+}
+
+/*
+ * The priority a generator gives a task of this kind (see
+ * TaskPriority).
+ */
+TaskPriority
+task_default_priority(TaskKind kind)
+{
+    return taskKindPriorities[kind];
+}
+
+const char*
+taskqueue_backend_name(TaskQueueBackend backend)
+{
+    return backendNames[backend];
+}
+
+bool
+taskqueue_backend_parse(const char* name, TaskQueueBackend* backend)
+{
+    for (int i = 0; i < NUM_TASKQUEUE_BACKENDS; i++)
+    {
+        if (strcmp(name, backendNames[i]) == 0)
+        {
+            *backend = (TaskQueueBackend) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char*
+overflow_policy_name(OverflowPolicy policy)
+{
+    return overflowNames[policy];
+}
+
+bool
+overflow_policy_parse(const char* name, OverflowPolicy* policy)
+{
+    for (int i = 0; i < NUM_OVERFLOW_POLICIES; i++)
+    {
+        if (strcmp(name, overflowNames[i]) == 0)
+        {
+            *policy = (OverflowPolicy) i;
+            return true;
+        }
+    }
+    return false;
+}
 
 TaskQueue::
-TaskQueue()
+TaskQueue(TaskQueueBackend queueBackend, int capacity, int numWorkers)
+    : backend(queueBackend), ring(NULL), scheduler(NULL), lanes(NULL),
+      discardHook(NULL), depth(0), highWater(0), rejected(0), dropped(0),
+      shed(0), sojournNs(0), blockedProducers(0)
 {
-    // TODO: Your code here.
+    smutex_init(&lock);
+    scond_init(&notEmpty);
+    smutex_init(&gate);
+    scond_init(&notFull);
+    if (backend == TASKQUEUE_RING)
+        ring = new TaskRing(capacity);
+    else if (backend == TASKQUEUE_STEALING)
+        scheduler = new StealingScheduler(numWorkers, capacity);
+    else if (backend == TASKQUEUE_PRIORITY)
+        lanes = new PriorityLanes();
+}
+
+/*
+ * Name every lock and condition variable in the queue for lock
+ * profiling (see smutex_set_name).
+ */
+void TaskQueue::
+setName(const char* name)
+{
+    smutex_set_name(&lock, name);
+    scond_set_name(&notEmpty, name);
+    smutex_set_name(&gate, name);
+    scond_set_name(&notFull, name);
+    if (ring)
+        ring->setName(name);
+    if (scheduler)
+        scheduler->setName(name);
+    if (lanes)
+        lanes->setName(name);
+}
+
+/*
+ * Set how long a task tolerates being overtaken per priority level
+ * (see PriorityLanes). Only the priority backend uses it.
+ */
+void TaskQueue::
+setAging(unsigned long long ns)
+{
+    if (lanes)
+        lanes->setAging(ns);
+}
+
+/*
+ * Set the capacity, overflow policy and admission target (see
+ * QueueLimits). Call before the queue is shared.
+ */
+void TaskQueue::
+setLimits(const QueueLimits& newLimits)
+{
+    limits = newLimits;
+}
+
+/*
+ * Set the function that releases tasks the queue refuses, drops or
+ * sheds. Call before the queue is shared.
+ */
+void TaskQueue::
+setDiscardHook(discard_t hook)
+{
+    discardHook = hook;
 }
 
 TaskQueue::
 ~TaskQueue()
 {
-    // TODO: Your code here.
+    delete lanes;
+    delete scheduler;
+    delete ring;
+    scond_destroy(&notFull);
+    smutex_destroy(&gate);
+    scond_destroy(&notEmpty);
+    smutex_destroy(&lock);
 }
 
 /*
@@ -27,8 +202,17 @@ TaskQueue::
 int TaskQueue::
 size()
 {
-    // TODO: Your code here.
-    return -999; // Keep compiler happy until routine done.
+    if (ring)
+        return ring->size();
+    if (scheduler)
+        return scheduler->size();
+    if (lanes)
+        return lanes->size();
+
+    smutex_lock(&lock);
+    int n = tasks.size();
+    smutex_unlock(&lock);
+    return n;
 }
 
 /*
@@ -45,15 +229,331 @@ size()
 bool TaskQueue::
 empty()
 {
-    // TODO: Your code here.
-    return false; // Keep compiler happy until routine done.
+    return size() == 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stats --
+ *
+ *      Return the queue's current depth, high-water mark, discard
+ *      counters and average queueing delay (see QueueStats).
+ *
+ * Results:
+ *      A snapshot of the counters; each is read separately.
+ *
+ * ------------------------------------------------------------------
+ */
+QueueStats TaskQueue::
+stats()
+{
+    QueueStats s;
+    s.depth = depth.load(std::memory_order_relaxed);
+    s.highWater = highWater.load(std::memory_order_relaxed);
+    s.rejected = rejected.load(std::memory_order_relaxed);
+    s.dropped = dropped.load(std::memory_order_relaxed);
+    s.shed = shed.load(std::memory_order_relaxed);
+    s.sojournNs = sojournNs.load(std::memory_order_relaxed);
+    return s;
+}
+
+/*
+ * Hand n admitted tasks to the backend, in order.
+ */
+void TaskQueue::
+pushBatch(const Task* batch, int n)
+{
+    if (n <= 0)
+        return;
+    if (ring)
+    {
+        if (n == 1)
+            ring->enqueue(batch[0]);
+        else
+            ring->enqueueBatch(batch, n);
+        return;
+    }
+    if (scheduler)
+    {
+        scheduler->submitBatch(batch, n);
+        return;
+    }
+    if (lanes)
+    {
+        if (n == 1)
+            lanes->enqueue(batch[0]);
+        else
+            lanes->enqueueBatch(batch, n);
+        return;
+    }
+
+    smutex_lock(&lock);
+    tasks.insert(tasks.end(), batch, batch + n);
+    if (n == 1)
+        scond_signal(&notEmpty, &lock);
+    else
+        scond_broadcast(&notEmpty, &lock);
+    smutex_unlock(&lock);
+}
+
+/*
+ * Take the next task from the backend, blocking while it is empty.
+ */
+Task TaskQueue::
+popOne()
+{
+    if (ring)
+        return ring->dequeue();
+    if (scheduler)
+        return scheduler->take();
+    if (lanes)
+        return lanes->dequeue();
+
+    smutex_lock(&lock);
+    while (tasks.empty())
+        scond_wait(&notEmpty, &lock);
+    Task task = tasks.front();
+    tasks.pop_front();
+    smutex_unlock(&lock);
+    return task;
+}
+
+/*
+ * Take up to max tasks from the backend, blocking while it is empty.
+ */
+int TaskQueue::
+popBatch(Task* out, int max)
+{
+    if (ring)
+        return ring->dequeueBatch(out, max);
+    if (scheduler)
+        return scheduler->takeBatch(out, max);
+    if (lanes)
+        return lanes->dequeueBatch(out, max);
+
+    smutex_lock(&lock);
+    while (tasks.empty())
+        scond_wait(&notEmpty, &lock);
+    int n = 0;
+    while (n < max && !tasks.empty())
+    {
+        out[n++] = tasks.front();
+        tasks.pop_front();
+    }
+    smutex_unlock(&lock);
+    return n;
+}
+
+/*
+ * Take the oldest task from the backend without blocking (see each
+ * backend's notion of oldest). Returns false if it is empty.
+ */
+bool TaskQueue::
+evict(Task* task)
+{
+    if (ring)
+        return ring->tryDequeue(task);
+    if (scheduler)
+        return scheduler->evict(task);
+    if (lanes)
+        return lanes->evict(task);
+
+    smutex_lock(&lock);
+    bool found = !tasks.empty();
+    if (found)
+    {
+        *task = tasks.front();
+        tasks.pop_front();
+    }
+    smutex_unlock(&lock);
+    return found;
+}
+
+/*
+ * Count n tasks in, regardless of capacity.
+ */
+void TaskQueue::
+reserve(int n)
+{
+    int now = depth.fetch_add(n) + n;
+    int high = highWater.load(std::memory_order_relaxed);
+    while (now > high
+           && !highWater.compare_exchange_weak(high, now,
+                                               std::memory_order_relaxed))
+        ;
+}
+
+/*
+ * Count one task in if the queue has room for it.
+ */
+bool TaskQueue::
+tryReserve()
+{
+    int d = depth.load(std::memory_order_relaxed);
+    do
+    {
+        if (d >= limits.capacity)
+            return false;
+    } while (!depth.compare_exchange_weak(d, d + 1));
+
+    int high = highWater.load(std::memory_order_relaxed);
+    while (d + 1 > high
+           && !highWater.compare_exchange_weak(high, d + 1,
+                                               std::memory_order_relaxed))
+        ;
+    return true;
+}
+
+void TaskQueue::
+discard(const Task& task, std::atomic<long>* counter)
+{
+    counter->fetch_add(1, std::memory_order_relaxed);
+    if (discardHook)
+        discardHook(task);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * admit --
+ *
+ *      Decide whether an arriving task may join the queue, and if
+ *      so count it in. Stop tasks always join. Otherwise, under
+ *      admission control, a task that is not PRIORITY_URGENT is
+ *      shed while queued tasks wait longer than the target on
+ *      average; then the overflow policy applies if the queue is
+ *      full.
+ *
+ * Results:
+ *      ADMIT_OK if the task was counted in, ADMIT_REFUSED if it was
+ *      discarded, and ADMIT_FULL if the producer must wait for
+ *      room (OVERFLOW_BLOCK).
+ *
+ * ------------------------------------------------------------------
+ */
+TaskQueue::Admission TaskQueue::
+admit(const Task& task)
+{
+    if (task.kind == TASK_STOP)
+    {
+        reserve(1);
+        return ADMIT_OK;
+    }
+
+    if (limits.targetSojournNs != 0 && task.priority != PRIORITY_URGENT
+        && depth.load(std::memory_order_relaxed) > 0
+        && sojournNs.load(std::memory_order_relaxed)
+           > limits.targetSojournNs)
+    {
+        discard(task, &shed);
+        return ADMIT_REFUSED;
+    }
+
+    if (limits.capacity <= 0)
+    {
+        reserve(1);
+        return ADMIT_OK;
+    }
+    if (tryReserve())
+        return ADMIT_OK;
+
+    switch (limits.overflow)
+    {
+    case OVERFLOW_REJECT:
+        discard(task, &rejected);
+        return ADMIT_REFUSED;
+    case OVERFLOW_DROP_OLDEST:
+        makeRoom();
+        return ADMIT_OK;
+    default:
+        return ADMIT_FULL;
+    }
+}
+
+/*
+ * Discard the oldest queued task and count the arriving one in in
+ * its place. If there is nothing to evict yet (the queued tasks are
+ * still on their way into the backend) or the oldest task is a stop,
+ * the arriving task is let in over capacity instead.
+ */
+void TaskQueue::
+makeRoom()
+{
+    Task victim;
+
+    if (evict(&victim))
+    {
+        if (victim.kind != TASK_STOP)
+        {
+            discard(victim, &dropped);
+            return;
+        }
+        pushBatch(&victim, 1);
+    }
+    reserve(1);
+}
+
+/*
+ * Block until a task can be counted in under capacity, then count
+ * it. blockedProducers and depth form a Dekker pair with release():
+ * a producer bumps blockedProducers and then re-reads depth, and
+ * release() drops depth and then reads blockedProducers. The fence
+ * keeps tryReserve's relaxed read of depth from being satisfied
+ * before the bump, so one side always sees the other.
+ */
+void TaskQueue::
+waitForRoom()
+{
+    smutex_lock(&gate);
+    blockedProducers.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!tryReserve())
+        scond_wait(&notFull, &gate);
+    blockedProducers.fetch_sub(1);
+    smutex_unlock(&gate);
+}
+
+/*
+ * Count n dequeued tasks out, fold their queueing delays into the
+ * moving average if admission control is on, and wake producers
+ * waiting for room.
+ */
+void TaskQueue::
+release(const Task* tasks, int n)
+{
+    depth.fetch_sub(n);
+
+    if (limits.targetSojournNs != 0)
+    {
+        // An exponentially weighted moving average with weight 1/8.
+        // Concurrent updates may lose a sample, which is harmless.
+        unsigned long long now = sthread_now_ns();
+        unsigned long long avg = sojournNs.load(std::memory_order_relaxed);
+        for (int i = 0; i < n; i++)
+        {
+            if (tasks[i].enqueueNs == 0 || tasks[i].enqueueNs > now)
+                continue;
+            unsigned long long delay = now - tasks[i].enqueueNs;
+            avg = avg - avg / 8 + delay / 8;
+        }
+        sojournNs.store(avg, std::memory_order_relaxed);
+    }
+
+    if (blockedProducers.load() == 0)
+        return;
+    smutex_lock(&gate);
+    if (n == 1)
+        scond_signal(&notFull, &gate);
+    else
+        scond_broadcast(&notFull, &gate);
+    smutex_unlock(&gate);
 }
 
 /*
  * ------------------------------------------------------------------
  * enqueue --
  *
- *      Insert the task at the back of the queue.
+ *      Insert the task at the back of the queue, subject to the
+ *      queue's limits (see admit).
  *
  * Results:
  *      None.
@@ -63,7 +563,7 @@ empty()
 void TaskQueue::
 enqueue(Task task)
 {
-    // TODO: Your code here.
+    enqueueBatch(&task, 1);
 }
 
 /*
@@ -81,7 +581,105 @@ enqueue(Task task)
 Task TaskQueue::
 dequeue()
 {
-    // TODO: Your code here.
-    return Task(); // Keep compiler happy until routine done.
+    Task task = popOne();
+    release(&task, 1);
+    return task;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Insert n tasks at the back of the queue, in order, with a
+ *      single lock acquisition and a single wakeup. Each task is
+ *      admitted separately (see admit): refused tasks are left out,
+ *      and if the producer must wait for room, the tasks admitted
+ *      so far are handed over first.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueBatch(const Task* batch, int n)
+{
+    int start = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        Admission verdict = admit(batch[i]);
+        if (verdict == ADMIT_OK)
+            continue;
+
+        pushBatch(batch + start, i - start);
+        start = i + 1;
+        if (verdict == ADMIT_FULL)
+        {
+            waitForRoom();
+            start = i;
+        }
+    }
+    pushBatch(batch + start, n - start);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueBatch --
+ *
+ *      Remove up to max Tasks from the front of the queue into out.
+ *      If the queue is empty, block until a Task is inserted.
+ *
+ * Results:
+ *      The number of Tasks removed (at least one).
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+dequeueBatch(Task* out, int max)
+{
+    int n = popBatch(out, max);
+    release(out, n);
+    return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * requeueBatch --
+ *
+ *      Hand n dequeued tasks back to the queue. They were admitted
+ *      once already, so they bypass the queue's limits, and the
+ *      call never blocks: a worker may hand work back to the queue
+ *      it alone drains. The ring backend spills what does not fit
+ *      (see TaskRing::requeueBatch), so there the tasks may run
+ *      ahead of ones already queued; the others are unbounded and
+ *      keep them in order.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+requeueBatch(const Task* batch, int n)
+{
+    if (n <= 0)
+        return;
+    reserve(n);
+    if (ring)
+        ring->requeueBatch(batch, n);
+    else
+        pushBatch(batch, n);
+}
+
+/*
+ * Tell the queue the calling thread will not dequeue again, so the
+ * stealing backend can give its deque to another thread. Threads
+ * that exit with the queue, as fixed workers do, need not call it.
+ */
+void TaskQueue::
+leave()
+{
+    if (scheduler)
+        scheduler->leave();
+}
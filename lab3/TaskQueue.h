@@ -1,15 +1,187 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 
+#include "Request.h"
 #include "sthread.h"
 
 typedef void (*handler_t) (void *); 
 
+/*
+ * What a Task does. TASK_CUSTOM runs handler(arg); every other kind
+ * is a store request whose payload is stored in the Task itself
+ * (except TASK_BUY_MANY_ITEMS, TASK_QUOTE_MANY and TASK_APPLY_UPDATES,
+ * whose arg is a pooled BuyManyItemsReq, QuoteManyReq or
+ * ApplyUpdatesReq)
+ * and is dispatched by run_task() in RequestHandlers.h.
+ */
+enum TaskKind {
+    TASK_CUSTOM = 0,
+    TASK_ADD_ITEM,
+    TASK_REMOVE_ITEM,
+    TASK_ADD_STOCK,
+    TASK_CHANGE_ITEM_PRICE,
+    TASK_CHANGE_ITEM_DISCOUNT,
+    TASK_SET_SHIPPING_COST,
+    TASK_SET_STORE_DISCOUNT,
+    TASK_BUY_ITEM,
+    TASK_BUY_MANY_ITEMS,
+    TASK_QUOTE,
+    TASK_QUOTE_MANY,
+    TASK_APPLY_UPDATES,
+    TASK_STOP,
+    NUM_TASK_KINDS
+};
+
+/*
+ * How urgently a Task should run, for the TASKQUEUE_PRIORITY backend
+ * (the others ignore it). Generators tag each task they make with
+ * task_default_priority(kind); the tag can be overridden before the
+ * task is enqueued.
+ *
+ *      PRIORITY_URGENT -- changes that may unblock waiting customers,
+ *                         such as restocks and price cuts.
+ *      PRIORITY_NORMAL -- purchases and quotes; the default.
+ *      PRIORITY_BULK   -- background traffic: supplier feeds, and
+ *                         the stop requests that end the workers
+ *                         once everything else is done.
+ */
+enum TaskPriority {
+    PRIORITY_URGENT = 0,
+    PRIORITY_NORMAL,
+    PRIORITY_BULK,
+    NUM_TASK_PRIORITIES
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Task --
+ *
+ *      One unit of work, copied by value through the queues. The
+ *      request payloads share storage with arg, so only the member
+ *      named by kind is meaningful. A default Task is an empty
+ *      TASK_CUSTOM task.
+ *
+ *      enqueueNs and dequeueNs (sthread_now_ns() times, 0 if never
+ *      set) are stamped by the generator and the worker so that
+ *      each task's queueing delay can be measured.
+ *
+ *      priority is only read by the TASKQUEUE_PRIORITY backend.
+ *
+ * ------------------------------------------------------------------
+ */
 struct Task {
     handler_t handler;
-    void* arg;
+    TaskKind kind;
+    TaskPriority priority;
+    union {
+        void* arg;
+        AddItemReq addItem;
+        RemoveItemReq removeItem;
+        AddStockReq addStock;
+        ChangeItemPriceReq changeItemPrice;
+        ChangeItemDiscountReq changeItemDiscount;
+        SetShippingCostReq setShippingCost;
+        SetStoreDiscountReq setStoreDiscount;
+        BuyItemReq buyItem;
+        QuoteReq quote;
+    };
+    unsigned long long enqueueNs;
+    unsigned long long dequeueNs;
+
+    Task()
+        : handler(NULL), kind(TASK_CUSTOM), priority(PRIORITY_NORMAL),
+          arg(NULL), enqueueNs(0), dequeueNs(0) { }
+};
+
+class TaskRing;
+class StealingScheduler;
+class PriorityLanes;
+
+/*
+ * Selects the implementation behind a TaskQueue.
+ *
+ *      TASKQUEUE_MONITOR  -- an unbounded deque guarded by a single
+ *                            mutex and condition variable.
+ *      TASKQUEUE_RING     -- a fixed-capacity lock-free MPMC ring
+ *                            (see TaskRing.h); producers block when
+ *                            it is full.
+ *      TASKQUEUE_STEALING -- per-worker Chase-Lev deques with random
+ *                            stealing (see WorkStealing.h). Each
+ *                            thread that dequeues becomes one of the
+ *                            numWorkers owners, until it leave()s.
+ *      TASKQUEUE_PRIORITY -- one monitor-guarded FIFO lane per
+ *                            TaskPriority, with aging (see
+ *                            PriorityLanes.h).
+ */
+enum TaskQueueBackend {
+    TASKQUEUE_MONITOR = 0,
+    TASKQUEUE_RING,
+    TASKQUEUE_STEALING,
+    TASKQUEUE_PRIORITY,
+    NUM_TASKQUEUE_BACKENDS
 };
 
+#define DEFAULT_RING_CAPACITY 1024
+
+/*
+ * What a bounded TaskQueue does with a task that arrives while it is
+ * full (see QueueLimits).
+ *
+ *      OVERFLOW_BLOCK       -- the producer waits for room.
+ *      OVERFLOW_REJECT      -- the new task is refused.
+ *      OVERFLOW_DROP_OLDEST -- the oldest queued task is discarded
+ *                              to make room for the new one.
+ */
+enum OverflowPolicy {
+    OVERFLOW_BLOCK = 0,
+    OVERFLOW_REJECT,
+    OVERFLOW_DROP_OLDEST,
+    NUM_OVERFLOW_POLICIES
+};
+
+/*
+ * Admission limits for a TaskQueue, enforced in front of whichever
+ * backend it uses. capacity bounds the number of queued tasks (0 for
+ * no bound) and overflow says what happens beyond it.
+ *
+ * A nonzero targetSojournNs turns on admission control: while the
+ * moving average of the time tasks wait before being dequeued is
+ * above the target, arriving tasks that are not PRIORITY_URGENT are
+ * shed instead of joining the queue.
+ *
+ * Stop tasks are always admitted and never dropped, so a bounded
+ * queue may briefly hold more than capacity tasks.
+ */
+struct QueueLimits {
+    int capacity;
+    OverflowPolicy overflow;
+    unsigned long long targetSojournNs;
+
+    QueueLimits()
+        : capacity(0), overflow(OVERFLOW_BLOCK), targetSojournNs(0) { }
+};
+
+/*
+ * A snapshot of a TaskQueue's admission counters. depth is the number
+ * of tasks admitted and not yet dequeued, highWater the largest depth
+ * so far, and sojournNs the current moving average queueing delay
+ * (only tracked under admission control).
+ */
+struct QueueStats {
+    int depth;
+    int highWater;
+    long rejected;
+    long dropped;
+    long shed;
+    unsigned long long sojournNs;
+};
+
+// Called with each task a TaskQueue refuses, drops or sheds, so that
+// whatever the task owns can be released.
+typedef void (*discard_t) (const Task& task);
+
 /*
  * ------------------------------------------------------------------
  * TaskQueue --
@@ -17,20 +189,96 @@ struct Task {
  *      A thread-safe task queue. This queue should be implemented
  *      as a monitor.
  *
+ *      The backend is fixed at construction so the monitor version
+ *      can be compared against the alternatives.
+ *
+ *      Admission (see QueueLimits) happens here, in front of the
+ *      backend: every task is counted in on enqueue and out on
+ *      dequeue, and the queue decides whether it may join at all.
+ *      A task the queue refuses or drops is passed to the discard
+ *      hook instead of running.
+ *
  * ------------------------------------------------------------------
  */
 class TaskQueue {
     private:
-    // TODO: More needed here.
+    const TaskQueueBackend backend;
+
+    // TASKQUEUE_MONITOR state.
+    std::deque<Task> tasks;
+    smutex_t lock;
+    scond_t notEmpty;
+
+    // TASKQUEUE_RING state.
+    TaskRing* ring;
+
+    // TASKQUEUE_STEALING state.
+    StealingScheduler* scheduler;
+
+    // TASKQUEUE_PRIORITY state.
+    PriorityLanes* lanes;
+
+    // Admission state, shared by every backend.
+    QueueLimits limits;
+    discard_t discardHook;
+    std::atomic<int> depth;
+    std::atomic<int> highWater;
+    std::atomic<long> rejected;
+    std::atomic<long> dropped;
+    std::atomic<long> shed;
+    std::atomic<unsigned long long> sojournNs;
+    std::atomic<int> blockedProducers;
+    smutex_t gate;
+    scond_t notFull;
+
+    enum Admission {
+        ADMIT_OK,
+        ADMIT_FULL,
+        ADMIT_REFUSED
+    };
+
+    void pushBatch(const Task* batch, int n);
+    Task popOne();
+    int popBatch(Task* out, int max);
+    bool evict(Task* task);
+
+    void reserve(int n);
+    bool tryReserve();
+    Admission admit(const Task& task);
+    void makeRoom();
+    void waitForRoom();
+    void release(const Task* tasks, int n);
+    void discard(const Task& task, std::atomic<long>* counter);
 
     public:
-    TaskQueue();
+    explicit TaskQueue(TaskQueueBackend queueBackend = TASKQUEUE_MONITOR,
+                       int capacity = DEFAULT_RING_CAPACITY,
+                       int numWorkers = 1);
     ~TaskQueue();
 
     void enqueue(Task task);
     Task dequeue();
 
+    void enqueueBatch(const Task* batch, int n);
+    int dequeueBatch(Task* out, int max);
+    void requeueBatch(const Task* batch, int n);
+    void leave();
+
     int size();
     bool empty();
+    QueueStats stats();
+
+    TaskQueueBackend getBackend() const { return backend; }
+
+    void setName(const char* name);
+    void setAging(unsigned long long ns);
+    void setLimits(const QueueLimits& newLimits);
+    void setDiscardHook(discard_t hook);
 };
 
+const char* taskqueue_backend_name(TaskQueueBackend backend);
+bool taskqueue_backend_parse(const char* name, TaskQueueBackend* backend);
+const char* task_kind_name(TaskKind kind);
+TaskPriority task_default_priority(TaskKind kind);
+const char* overflow_policy_name(OverflowPolicy policy);
+bool overflow_policy_parse(const char* name, OverflowPolicy* policy);
@@ -0,0 +1,444 @@
+#include <cassert>
+#include <cstdint>
+
+#include "TaskQueue.h"
+#include "TaskRing.h"
+
+using namespace std;
+
+// Number of failed attempts before a producer/consumer parks.
+#define RING_SPIN_TRIES 128
+
+struct alignas(CACHE_LINE_SIZE) TaskRing::Slot {
+    atomic<size_t> seq;
+    Task task;
+};
+
+static size_t
+round_up_pow2(int n)
+{
+    size_t cap = 1;
+    while (cap < (size_t) n)
+        cap <<= 1;
+    return cap;
+}
+
+TaskRing::
+TaskRing(int capacity)
+    : mask(round_up_pow2(capacity) - 1), head(0), tail(0),
+      parkedConsumers(0), parkedProducers(0), spilled(0)
+{
+    assert(capacity > 0);
+    slots = new Slot[mask + 1];
+    for (size_t i = 0; i <= mask; i++)
+        slots[i].seq.store(i, memory_order_relaxed);
+    smutex_init(&lock);
+    scond_init(&notEmpty);
+    scond_init(&notFull);
+    smutex_init(&spillLock);
+    spill = new deque<Task>();
+}
+
+void TaskRing::
+setName(const char* name)
+{
+    smutex_set_name(&lock, name);
+    scond_set_name(&notEmpty, name);
+    scond_set_name(&notFull, name);
+    smutex_set_name(&spillLock, name);
+}
+
+TaskRing::
+~TaskRing()
+{
+    delete spill;
+    smutex_destroy(&spillLock);
+    scond_destroy(&notFull);
+    scond_destroy(&notEmpty);
+    smutex_destroy(&lock);
+    delete[] slots;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * push --
+ *
+ *      Claim the slot at the tail and publish the task into it.
+ *      Does not wake parked consumers.
+ *
+ * Results:
+ *      False if the ring is full, true otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskRing::
+push(const Task& task)
+{
+    size_t pos = tail.load(memory_order_relaxed);
+    for (;;)
+    {
+        Slot* slot = &slots[pos & mask];
+        size_t seq = slot->seq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {
+            if (tail.compare_exchange_weak(pos, pos + 1,
+                                           memory_order_relaxed))
+            {
+                slot->task = task;
+                slot->seq.store(pos + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;
+        else
+            pos = tail.load(memory_order_relaxed);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pop --
+ *
+ *      Claim the slot at the head and copy its task out. Does not
+ *      wake parked producers.
+ *
+ * Results:
+ *      False if the ring is empty, true otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskRing::
+pop(Task* task)
+{
+    size_t pos = head.load(memory_order_relaxed);
+    for (;;)
+    {
+        Slot* slot = &slots[pos & mask];
+        size_t seq = slot->seq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0)
+        {
+            if (head.compare_exchange_weak(pos, pos + 1,
+                                           memory_order_relaxed))
+            {
+                *task = slot->task;
+                slot->seq.store(pos + mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;
+        else
+            pos = head.load(memory_order_relaxed);
+    }
+}
+
+/*
+ * Move up to max tasks from the front of the spill list into out.
+ * Returns the number moved.
+ */
+int TaskRing::
+unspill(Task* out, int max)
+{
+    int n = 0;
+
+    smutex_lock(&spillLock);
+    while (n < max && !spill->empty())
+    {
+        out[n++] = spill->front();
+        spill->pop_front();
+    }
+    spilled.fetch_sub(n, memory_order_relaxed);
+    smutex_unlock(&spillLock);
+    return n;
+}
+
+/*
+ * Take up to max tasks, spilled ones first, without blocking.
+ */
+int TaskRing::
+popMany(Task* out, int max)
+{
+    int n = 0;
+    if (spilled.load(memory_order_relaxed) > 0)
+        n = unspill(out, max);
+    while (n < max && pop(&out[n]))
+        n++;
+    return n;
+}
+
+/*
+ * The parked counters and the ring indices (and spilled) form a
+ * Dekker pair: a parking thread bumps its counter and then re-checks
+ * the ring, and a publishing thread updates the ring and then checks
+ * the counter. The seq_cst fences on both sides guarantee at least
+ * one of them sees the other.
+ *
+ * n is the number of slots just filled (or freed); more than one
+ * may satisfy several parked peers, so broadcast.
+ */
+void TaskRing::
+wakeConsumers(int n)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (n == 0 || parkedConsumers.load(memory_order_relaxed) == 0)
+        return;
+    smutex_lock(&lock);
+    if (n == 1)
+        scond_signal(&notEmpty, &lock);
+    else
+        scond_broadcast(&notEmpty, &lock);
+    smutex_unlock(&lock);
+}
+
+void TaskRing::
+wakeProducers(int n)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (n == 0 || parkedProducers.load(memory_order_relaxed) == 0)
+        return;
+    smutex_lock(&lock);
+    if (n == 1)
+        scond_signal(&notFull, &lock);
+    else
+        scond_broadcast(&notFull, &lock);
+    smutex_unlock(&lock);
+}
+
+bool TaskRing::
+tryEnqueue(const Task& task)
+{
+    if (!push(task))
+        return false;
+    wakeConsumers(1);
+    return true;
+}
+
+bool TaskRing::
+tryDequeue(Task* task)
+{
+    if (popMany(task, 1) == 0)
+        return false;
+    wakeProducers(1);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue --
+ *
+ *      Insert the task at the back of the ring. If the ring is
+ *      full, spin for a while and then block until a consumer
+ *      frees a slot.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskRing::
+enqueue(const Task& task)
+{
+    for (int i = 0; i < RING_SPIN_TRIES; i++)
+    {
+        if (tryEnqueue(task))
+            return;
+        sthread_relax();
+    }
+
+    smutex_lock(&lock);
+    parkedProducers.fetch_add(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!push(task))
+        scond_wait(&notFull, &lock);
+    parkedProducers.fetch_sub(1);
+    smutex_unlock(&lock);
+    wakeConsumers(1);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeue --
+ *
+ *      Remove the Task at the front of the ring and return it. If
+ *      the ring is empty, spin for a while and then block until a
+ *      Task is inserted.
+ *
+ * Results:
+ *      The Task at the front of the ring.
+ *
+ * ------------------------------------------------------------------
+ */
+Task TaskRing::
+dequeue()
+{
+    Task task;
+
+    for (int i = 0; i < RING_SPIN_TRIES; i++)
+    {
+        if (tryDequeue(&task))
+            return task;
+        sthread_relax();
+    }
+
+    smutex_lock(&lock);
+    parkedConsumers.fetch_add(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (popMany(&task, 1) == 0)
+        scond_wait(&notEmpty, &lock);
+    parkedConsumers.fetch_sub(1);
+    smutex_unlock(&lock);
+    wakeProducers(1);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Insert n tasks at the back of the ring, in order, waking
+ *      parked consumers once at the end. Blocks while the ring is
+ *      full, as enqueue does.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskRing::
+enqueueBatch(const Task* tasks, int n)
+{
+    int done = 0;
+
+    for (int spins = 0; done < n && spins < RING_SPIN_TRIES; )
+    {
+        if (push(tasks[done]))
+            done++;
+        else
+        {
+            spins++;
+            sthread_relax();
+        }
+    }
+
+    if (done < n)
+    {
+        wakeConsumers(done);
+
+        smutex_lock(&lock);
+        parkedProducers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (done < n)
+        {
+            if (push(tasks[done]))
+            {
+                done++;
+                continue;
+            }
+            // Whatever we pushed must be visible to consumers before we
+            // sleep waiting for them to free a slot.
+            if (parkedConsumers.load() > 0)
+                scond_broadcast(&notEmpty, &lock);
+            scond_wait(&notFull, &lock);
+        }
+        parkedProducers.fetch_sub(1);
+        smutex_unlock(&lock);
+    }
+    wakeConsumers(n);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueBatch --
+ *
+ *      Remove up to max Tasks from the front of the ring into out.
+ *      If the ring is empty, spin for a while and then block until
+ *      at least one Task is inserted.
+ *
+ * Results:
+ *      The number of Tasks removed (at least one).
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskRing::
+dequeueBatch(Task* out, int max)
+{
+    int n;
+
+    for (int i = 0; i < RING_SPIN_TRIES; i++)
+    {
+        if ((n = popMany(out, max)) > 0)
+        {
+            wakeProducers(n);
+            return n;
+        }
+        sthread_relax();
+    }
+
+    smutex_lock(&lock);
+    parkedConsumers.fetch_add(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((n = popMany(out, max)) == 0)
+        scond_wait(&notEmpty, &lock);
+    parkedConsumers.fetch_sub(1);
+    smutex_unlock(&lock);
+    wakeProducers(n);
+    return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * requeueBatch --
+ *
+ *      Hand n tasks back to the ring without ever blocking. They
+ *      go into the ring while it has room and once it is full (or
+ *      tasks are already spilled, to keep them in order) into the
+ *      spill list. Spilled tasks are taken ahead of the ring's.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskRing::
+requeueBatch(const Task* tasks, int n)
+{
+    int done = 0;
+
+    if (spilled.load(memory_order_relaxed) == 0)
+    {
+        while (done < n && push(tasks[done]))
+            done++;
+    }
+    if (done < n)
+    {
+        smutex_lock(&spillLock);
+        spill->insert(spill->end(), tasks + done, tasks + n);
+        spilled.fetch_add(n - done, memory_order_relaxed);
+        smutex_unlock(&spillLock);
+    }
+    wakeConsumers(n);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * size --
+ *
+ *      Return the number of tasks in the ring. The value is only a
+ *      snapshot: concurrent operations may change it at any time.
+ *
+ * Results:
+ *      The approximate size of the ring.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskRing::
+size()
+{
+    size_t h = head.load(memory_order_acquire);
+    size_t t = tail.load(memory_order_acquire);
+    int n = spilled.load(memory_order_relaxed);
+    return (t > h ? (int) (t - h) : 0) + n;
+}
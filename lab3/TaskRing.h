@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+
+#include "sthread.h"
+
+struct Task;
+
+/*
+ * ------------------------------------------------------------------
+ * TaskRing --
+ *
+ *      A fixed-capacity, lock-free, multi-producer/multi-consumer
+ *      ring of Tasks (after Vyukov's bounded MPMC queue). Each slot
+ *      carries a sequence number that tells producers and consumers
+ *      whose turn it is, so the fast path is a single CAS on the
+ *      head or tail index.
+ *
+ *      tryEnqueue/tryDequeue never block. enqueue/dequeue spin
+ *      briefly and then park on a condition variable until the
+ *      ring is no longer full/empty. The lock is only touched on
+ *      the slow path, or when a peer is known to be parked.
+ *
+ *      requeueBatch never blocks: what does not fit in the ring
+ *      goes to an unbounded spill list, which consumers drain
+ *      before the ring. Workers that hand tasks back to their own
+ *      queue use it, as nothing else would empty a full ring.
+ *
+ * ------------------------------------------------------------------
+ */
+class TaskRing {
+    private:
+    struct Slot;
+
+    Slot* slots;
+    const size_t mask;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<int> parkedConsumers;
+    std::atomic<int> parkedProducers;
+    smutex_t lock;
+    scond_t notEmpty;
+    scond_t notFull;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<int> spilled;
+    smutex_t spillLock;
+    std::deque<Task>* spill;
+
+    bool push(const Task& task);
+    bool pop(Task* task);
+    int unspill(Task* out, int max);
+    int popMany(Task* out, int max);
+    void wakeConsumers(int n);
+    void wakeProducers(int n);
+
+    public:
+    explicit TaskRing(int capacity);
+    ~TaskRing();
+
+    void setName(const char* name);
+
+    bool tryEnqueue(const Task& task);
+    bool tryDequeue(Task* task);
+
+    void enqueue(const Task& task);
+    Task dequeue();
+
+    void enqueueBatch(const Task* tasks, int n);
+    int dequeueBatch(Task* out, int max);
+
+    void requeueBatch(const Task* tasks, int n);
+
+    int size();
+    int capacity() const { return (int) mask + 1; }
+};
@@ -0,0 +1,594 @@
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+
+#include "TaskQueue.h"
+#include "WorkStealing.h"
+
+using namespace std;
+
+// Number of tasks a worker moves from its inbox into its deque at once.
+#define INBOX_BATCH 16
+
+// Number of full steal sweeps before a worker parks.
+#define STEAL_SWEEPS 4
+
+static_assert(std::is_trivially_copyable<Task>::value,
+              "WorkDeque copies Tasks word by word");
+
+/*
+ * A deque slot holds its Task as relaxed atomic words. A thief may
+ * read a slot while the owner refills it after the deque wrapped;
+ * with plain Task copies that would be a data race. The thief's CAS
+ * on top then fails and the torn copy is thrown away.
+ */
+struct WorkDeque::Slot {
+    static const int WORDS =
+        (sizeof(Task) + sizeof(unsigned long) - 1) / sizeof(unsigned long);
+
+    atomic<unsigned long> words[WORDS];
+
+    void store(const Task& task)
+    {
+        unsigned long raw[WORDS] = { 0 };
+        memcpy(raw, &task, sizeof(Task));
+        for (int i = 0; i < WORDS; i++)
+            words[i].store(raw[i], memory_order_relaxed);
+    }
+
+    void load(Task* task) const
+    {
+        unsigned long raw[WORDS];
+        for (int i = 0; i < WORDS; i++)
+            raw[i] = words[i].load(memory_order_relaxed);
+        memcpy((void*) task, raw, sizeof(Task));
+    }
+};
+
+WorkDeque::
+WorkDeque(int capacity)
+    : mask(capacity - 1), top(0), bottom(0)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    buffer = new Slot[capacity];
+}
+
+WorkDeque::
+~WorkDeque()
+{
+    delete[] buffer;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * push --
+ *
+ *      Owner only. Insert the task at the bottom of the deque.
+ *
+ * Results:
+ *      False if the deque is full, true otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+push(const Task& task)
+{
+    long b = bottom.load(memory_order_relaxed);
+    long t = top.load(memory_order_acquire);
+    if (b - t > mask)
+        return false;
+    buffer[b & mask].store(task);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pop --
+ *
+ *      Owner only. Remove the task at the bottom of the deque. Races
+ *      with thieves only for the last remaining task.
+ *
+ * Results:
+ *      False if the deque is empty, true otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+pop(Task* task)
+{
+    long b = bottom.load(memory_order_relaxed) - 1;
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = top.load(memory_order_relaxed);
+
+    if (t > b)
+    {
+        bottom.store(b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    buffer[b & mask].load(task);
+    if (t == b)
+    {
+        bool won = top.compare_exchange_strong(t, t + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed);
+        bottom.store(b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * steal --
+ *
+ *      Remove the task at the top of the deque. The slot may be
+ *      copied while the owner overwrites it, but only when the deque
+ *      wrapped underneath us, in which case the CAS on top fails and
+ *      the copy is discarded. Slots are atomic words (see Slot), so
+ *      the overlap is not a data race.
+ *
+ * Results:
+ *      False if the deque was empty or the race was lost.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+steal(Task* task)
+{
+    long t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = bottom.load(memory_order_acquire);
+    if (t >= b)
+        return false;
+
+    Task copy;
+    buffer[t & mask].load(&copy);
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                     memory_order_relaxed))
+        return false;
+    *task = copy;
+    return true;
+}
+
+int WorkDeque::
+size()
+{
+    long b = bottom.load(memory_order_relaxed);
+    long t = top.load(memory_order_relaxed);
+    return b > t ? (int) (b - t) : 0;
+}
+
+
+struct alignas(CACHE_LINE_SIZE) StealingScheduler::Worker {
+    WorkDeque deque;
+    smutex_t inboxLock;
+    std::deque<Task> inbox;
+
+    explicit Worker(int capacity) : deque(capacity)
+    {
+        smutex_init(&inboxLock);
+    }
+
+    ~Worker()
+    {
+        smutex_destroy(&inboxLock);
+    }
+};
+
+/*
+ * Each thread remembers which deque it claimed in each scheduler it
+ * has taken from, by scheduler id (never reused, unlike addresses,
+ * and 0 for an unused entry); index -1 marks a steal-only thread.
+ */
+struct Ownership {
+    unsigned long scheduler;
+    int index;
+};
+
+static atomic<unsigned long> nextSchedulerId(1);
+static thread_local Ownership owned[MAX_OWNED_SCHEDULERS];
+static thread_local unsigned victimSeed = 0;
+
+/*
+ * Return the calling thread's entry for scheduler id. With create
+ * set, make one if there is none; NULL if all entries are taken.
+ */
+static Ownership*
+find_ownership(unsigned long id, bool create)
+{
+    Ownership* unused = NULL;
+
+    for (int i = 0; i < MAX_OWNED_SCHEDULERS; i++)
+    {
+        if (owned[i].scheduler == id)
+            return &owned[i];
+        if (unused == NULL && owned[i].scheduler == 0)
+            unused = &owned[i];
+    }
+    if (!create || unused == NULL)
+        return NULL;
+    unused->scheduler = id;
+    unused->index = -1;
+    return unused;
+}
+
+StealingScheduler::
+StealingScheduler(int workerCount, int dequeCapacity)
+    : numWorkers(workerCount), id(nextSchedulerId.fetch_add(1)),
+      nextInbox(0), nextWorker(0), pending(0), parked(0),
+      numFree(workerCount)
+{
+    assert(workerCount > 0);
+
+    int capacity = 1;
+    while (capacity < dequeCapacity)
+        capacity <<= 1;
+
+    workers = new Worker*[numWorkers];
+    for (int i = 0; i < numWorkers; i++)
+        workers[i] = new Worker(capacity);
+
+    // Claimed from the end, so the first thread gets deque 0.
+    freeOwners = new int[numWorkers];
+    for (int i = 0; i < numWorkers; i++)
+        freeOwners[i] = numWorkers - 1 - i;
+
+    smutex_init(&lock);
+    scond_init(&workAvailable);
+}
+
+void StealingScheduler::
+setName(const char* name)
+{
+    smutex_set_name(&lock, name);
+    scond_set_name(&workAvailable, name);
+    for (int i = 0; i < numWorkers; i++)
+        smutex_set_name(&workers[i]->inboxLock, name);
+}
+
+StealingScheduler::
+~StealingScheduler()
+{
+    scond_destroy(&workAvailable);
+    smutex_destroy(&lock);
+    for (int i = 0; i < numWorkers; i++)
+        delete workers[i];
+    delete[] workers;
+    delete[] freeOwners;
+}
+
+/*
+ * Return the calling thread's deque, claiming a free one if it has
+ * none; -1 if it has to make do with stealing. A steal-only thread
+ * looks for a free deque again on every call, which is cheap while
+ * there is none.
+ */
+int StealingScheduler::
+self()
+{
+    if (victimSeed == 0)
+        victimSeed = 2654435761u * (nextWorker.fetch_add(1) + 1);
+
+    Ownership* own = find_ownership(id, true);
+    if (own == NULL)
+        return -1;
+    if (own->index < 0 && numFree.load(memory_order_relaxed) > 0)
+        own->index = claim();
+    return own->index;
+}
+
+int StealingScheduler::
+claim()
+{
+    int index = -1;
+
+    smutex_lock(&lock);
+    int n = numFree.load(memory_order_relaxed);
+    if (n > 0)
+    {
+        index = freeOwners[n - 1];
+        numFree.store(n - 1, memory_order_relaxed);
+    }
+    smutex_unlock(&lock);
+    return index;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * leave --
+ *
+ *      Called by a worker that will take no more tasks. Move what is
+ *      left in its deque to the front of its inbox, in order, and
+ *      free the deque for the next thread to call take(). The tasks
+ *      stay pending, so other workers steal them meanwhile.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingScheduler::
+leave()
+{
+    Ownership* own = find_ownership(id, false);
+    if (own == NULL)
+        return;
+
+    int index = own->index;
+    own->scheduler = 0;
+    if (index < 0)
+        return;
+
+    Worker* w = workers[index];
+    std::deque<Task> left;
+    Task task;
+    while (w->deque.pop(&task))
+        left.push_back(task);
+
+    smutex_lock(&w->inboxLock);
+    w->inbox.insert(w->inbox.begin(), left.begin(), left.end());
+    smutex_unlock(&w->inboxLock);
+
+    smutex_lock(&lock);
+    int n = numFree.load(memory_order_relaxed);
+    freeOwners[n] = index;
+    numFree.store(n + 1, memory_order_relaxed);
+    smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * submit --
+ *
+ *      Hand the task to the next worker's inbox, round-robin, and
+ *      wake a parked worker if there is one.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingScheduler::
+submit(const Task& task)
+{
+    submitBatch(&task, 1);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * submitBatch --
+ *
+ *      Hand all n tasks to the next worker's inbox under one lock
+ *      acquisition. Idle workers will steal their share.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingScheduler::
+submitBatch(const Task* tasks, int n)
+{
+    if (n <= 0)
+        return;
+
+    Worker* w = workers[nextInbox.fetch_add(1, memory_order_relaxed)
+                        % numWorkers];
+
+    smutex_lock(&w->inboxLock);
+    w->inbox.insert(w->inbox.end(), tasks, tasks + n);
+    smutex_unlock(&w->inboxLock);
+
+    pending.fetch_add(n);
+    wakeWorkers(n);
+}
+
+/*
+ * pending and parked form a Dekker pair, as in TaskRing: a parking
+ * worker bumps parked and re-checks pending, a submitter bumps
+ * pending and then checks parked.
+ */
+void StealingScheduler::
+wakeWorkers(int n)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (parked.load(memory_order_relaxed) == 0)
+        return;
+    smutex_lock(&lock);
+    if (n == 1)
+        scond_signal(&workAvailable, &lock);
+    else
+        scond_broadcast(&workAvailable, &lock);
+    smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * refill --
+ *
+ *      Move up to INBOX_BATCH tasks from the worker's inbox into its
+ *      deque and return the oldest one. The rest are pushed newest
+ *      first so the owner keeps popping them in arrival order while
+ *      thieves take the newest.
+ *
+ * Results:
+ *      False if the inbox was empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool StealingScheduler::
+refill(int index, Task* task)
+{
+    Worker* w = workers[index];
+    Task batch[INBOX_BATCH];
+    int n = 0;
+
+    smutex_lock(&w->inboxLock);
+    while (n < INBOX_BATCH && !w->inbox.empty())
+    {
+        batch[n++] = w->inbox.front();
+        w->inbox.pop_front();
+    }
+    smutex_unlock(&w->inboxLock);
+
+    if (n == 0)
+        return false;
+
+    *task = batch[0];
+    for (int i = n - 1; i > 0; i--)
+    {
+        if (!w->deque.push(batch[i]))
+        {
+            // Deque full: put the remainder back in order.
+            smutex_lock(&w->inboxLock);
+            for (; i > 0; i--)
+                w->inbox.push_front(batch[i]);
+            smutex_unlock(&w->inboxLock);
+            break;
+        }
+    }
+    return true;
+}
+
+bool StealingScheduler::
+stealFrom(int victim, Task* task)
+{
+    Worker* w = workers[victim];
+
+    if (w->deque.steal(task))
+        return true;
+
+    // The victim may be busy (or blocked) with a full inbox.
+    bool found = false;
+    smutex_lock(&w->inboxLock);
+    if (!w->inbox.empty())
+    {
+        *task = w->inbox.front();
+        w->inbox.pop_front();
+        found = true;
+    }
+    smutex_unlock(&w->inboxLock);
+    return found;
+}
+
+/*
+ * Remove some queued task without blocking or becoming a worker, as
+ * a thief would, for a producer that must make room. There is no
+ * global arrival order, so this is only roughly the oldest task.
+ * Returns false if no task was found.
+ */
+bool StealingScheduler::
+evict(Task* task)
+{
+    for (int i = 0; i < numWorkers; i++)
+    {
+        if (stealFrom(i, task))
+        {
+            pending.fetch_sub(1, memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool StealingScheduler::
+tryTake(int index, Task* task)
+{
+    if (index >= 0)
+    {
+        if (workers[index]->deque.pop(task) || refill(index, task))
+            return true;
+    }
+
+    for (int sweep = 0; sweep < STEAL_SWEEPS; sweep++)
+    {
+        victimSeed = victimSeed * 1103515245u + 12345u;
+        int start = (victimSeed >> 16) % numWorkers;
+        for (int i = 0; i < numWorkers; i++)
+        {
+            int victim = (start + i) % numWorkers;
+            if (victim != index && stealFrom(victim, task))
+                return true;
+        }
+        if (pending.load(memory_order_relaxed) <= 0)
+            break;
+        sthread_relax();
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * take --
+ *
+ *      Return the next task for the calling worker: from its own
+ *      deque, then its inbox, then by stealing. Block while no task
+ *      is pending anywhere.
+ *
+ * Results:
+ *      The task to run.
+ *
+ * ------------------------------------------------------------------
+ */
+Task StealingScheduler::
+take()
+{
+    int index = self();
+    Task task;
+
+    for (;;)
+    {
+        if (tryTake(index, &task))
+        {
+            pending.fetch_sub(1, memory_order_relaxed);
+            return task;
+        }
+
+        smutex_lock(&lock);
+        parked.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (pending.load(memory_order_relaxed) <= 0)
+            scond_wait(&workAvailable, &lock);
+        parked.fetch_sub(1);
+        smutex_unlock(&lock);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeBatch --
+ *
+ *      Like take(), but once a task is found also drain up to max-1
+ *      more from the worker's own deque.
+ *
+ * Results:
+ *      The number of tasks stored in out (at least one).
+ *
+ * ------------------------------------------------------------------
+ */
+int StealingScheduler::
+takeBatch(Task* out, int max)
+{
+    out[0] = take();
+
+    int index = self();
+    int n = 1;
+    if (index >= 0)
+    {
+        while (n < max && workers[index]->deque.pop(&out[n]))
+            n++;
+        pending.fetch_sub(n - 1, memory_order_relaxed);
+    }
+    return n;
+}
+
+int StealingScheduler::
+size()
+{
+    int n = pending.load(memory_order_relaxed);
+    return n > 0 ? n : 0;
+}
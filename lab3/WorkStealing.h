@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+
+#include "TaskRing.h"
+#include "sthread.h"
+
+struct Task;
+
+// Most schedulers one thread can own a deque in at once.
+#define MAX_OWNED_SCHEDULERS 4
+
+/*
+ * ------------------------------------------------------------------
+ * WorkDeque --
+ *
+ *      A fixed-capacity Chase-Lev work-stealing deque. Only the
+ *      owning worker may push() and pop() (at the bottom); any
+ *      thread may steal() (from the top).
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkDeque {
+    private:
+    struct Slot;
+
+    Slot* buffer;
+    const long mask;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<long> top;
+    alignas(CACHE_LINE_SIZE) std::atomic<long> bottom;
+
+    public:
+    explicit WorkDeque(int capacity);
+    ~WorkDeque();
+
+    bool push(const Task& task);
+    bool pop(Task* task);
+    bool steal(Task* task);
+
+    int size();
+};
+
+/*
+ * ------------------------------------------------------------------
+ * StealingScheduler --
+ *
+ *      A set of per-worker deques. submit() hands tasks out to the
+ *      workers round-robin through a small per-worker inbox; each
+ *      worker moves its inbox into its own deque, runs tasks from
+ *      there and, once it runs dry, steals from random victims.
+ *      Workers park only when no task is pending anywhere.
+ *
+ *      A thread becomes a worker the first time it calls take(),
+ *      claiming a free deque. Threads that find none only steal,
+ *      until a worker that leaves() frees its deque for them. A
+ *      thread may own a deque in up to MAX_OWNED_SCHEDULERS
+ *      schedulers at once, and only steals in any more.
+ *
+ * ------------------------------------------------------------------
+ */
+class StealingScheduler {
+    private:
+    struct Worker;
+
+    Worker** workers;
+    const int numWorkers;
+    const unsigned long id;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> nextInbox;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> nextWorker;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> pending;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<int> parked;
+    smutex_t lock;
+    scond_t workAvailable;
+
+    // Deques no thread owns, guarded by lock.
+    int* freeOwners;
+    std::atomic<int> numFree;
+
+    int self();
+    int claim();
+    bool refill(int index, Task* task);
+    bool stealFrom(int victim, Task* task);
+    bool tryTake(int index, Task* task);
+    void wakeWorkers(int n);
+
+    public:
+    StealingScheduler(int numWorkers, int dequeCapacity);
+    ~StealingScheduler();
+
+    void setName(const char* name);
+
+    void submit(const Task& task);
+    Task take();
+
+    void submitBatch(const Task* tasks, int n);
+    int takeBatch(Task* out, int max);
+
+    bool evict(Task* task);
+    void leave();
+
+    int size();
+};
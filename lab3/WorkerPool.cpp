@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <cassert>
+
+#include "RequestHandlers.h"
+#include "WorkerPool.h"
+
+/*
+ * A retire marker is a TASK_CUSTOM task with this handler. Workers
+ * recognize it and never run it.
+ */
+static void
+retire_marker(void* arg)
+{
+}
+
+static inline bool
+task_is_retire(const Task& task)
+{
+    return task.kind == TASK_CUSTOM && task.handler == retire_marker;
+}
+
+WorkerPool::
+WorkerPool(TaskQueue* taskQueue, const PoolOptions& poolOptions,
+           int workerBatch)
+    : queue(taskQueue), options(poolOptions), batchSize(workerBatch),
+      live(0), stopping(false), peak(0), spawned(0), retired(0)
+{
+    assert(options.minWorkers >= 1);
+    assert(options.minWorkers <= options.maxWorkers);
+    assert(options.maxWorkers <= MAX_POOL_WORKERS);
+    assert(batchSize >= 1 && batchSize <= MAX_WORKER_BATCH);
+
+    slots = new Slot[options.maxWorkers];
+    for (int i = 0; i < options.maxWorkers; i++)
+        slots[i].pool = this;
+}
+
+WorkerPool::
+~WorkerPool()
+{
+    delete[] slots;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Start minWorkers workers and the manager thread.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+start()
+{
+    for (int i = 0; i < options.minWorkers; i++)
+        spawn();
+    sthread_create(&manager, managerMain, this);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * join --
+ *
+ *      Wait until a stop task has ended every worker, then join
+ *      the manager and the workers it has not yet joined.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+join()
+{
+    sthread_join(manager);
+    reap(true);
+}
+
+/*
+ * Return the pool's counters. live is a snapshot; the others are
+ * only exact once join() has returned.
+ */
+WorkerPoolStats WorkerPool::
+stats()
+{
+    WorkerPoolStats s;
+    s.live = live.load();
+    s.peak = peak;
+    s.spawned = spawned;
+    s.retired = retired.load();
+    return s;
+}
+
+void* WorkerPool::
+workerMain(void* arg)
+{
+    Slot* slot = (Slot*) arg;
+    slot->pool->runWorker(slot);
+    return NULL; // Keep compiler happy.
+}
+
+void* WorkerPool::
+managerMain(void* arg)
+{
+    ((WorkerPool*) arg)->manage();
+    return NULL;
+}
+
+/*
+ * Start a worker in a free slot. Only the manager (or start(),
+ * before there is a manager) calls this. Returns false if every
+ * slot is taken.
+ */
+bool WorkerPool::
+spawn()
+{
+    for (int i = 0; i < options.maxWorkers; i++)
+    {
+        Slot* slot = &slots[i];
+        if (slot->state.load() != SLOT_FREE)
+            continue;
+
+        slot->busySince.store(0, std::memory_order_relaxed);
+        slot->state.store(SLOT_LIVE);
+        int now = live.fetch_add(1) + 1;
+        peak = std::max(peak, now);
+        spawned++;
+        sthread_create(&slot->thread, workerMain, slot);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Join the workers that have exited and free their slots. With wait
+ * set, join every worker, waiting for those still running.
+ */
+void WorkerPool::
+reap(bool wait)
+{
+    for (int i = 0; i < options.maxWorkers; i++)
+    {
+        Slot* slot = &slots[i];
+        int state = slot->state.load();
+        if (state == SLOT_EXITED || (wait && state == SLOT_LIVE))
+        {
+            sthread_join(slot->thread);
+            slot->state.store(SLOT_FREE);
+        }
+    }
+}
+
+/*
+ * Hand the queue a retire marker. It bypasses the queue's limits,
+ * as a marker must not be refused, and never blocks, so the manager
+ * keeps running while the queue is full.
+ */
+void WorkerPool::
+retire()
+{
+    Task marker;
+    marker.handler = retire_marker;
+    marker.arg = this;
+    queue->requeueBatch(&marker, 1);
+}
+
+/*
+ * Count the calling worker out of the pool on a retire marker. Once
+ * the pool is stopping every marker ends a worker; before that, a
+ * worker only leaves while more than minWorkers remain. Returns true
+ * if the worker should exit.
+ */
+bool WorkerPool::
+leave()
+{
+    if (stopping.load())
+    {
+        live.fetch_sub(1);
+        return true;
+    }
+
+    int n = live.load();
+    do
+    {
+        if (n <= options.minWorkers)
+            return false;
+    } while (!live.compare_exchange_weak(n, n - 1));
+    retired.fetch_add(1);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runWorker --
+ *
+ *      The body of a worker: take up to batchSize tasks from the
+ *      queue at a time and run them in order, publishing when each
+ *      task started so the manager can tell a blocked worker from a
+ *      busy one.
+ *
+ *      A stop task puts the pool in its stopping state and is not
+ *      run. On a retire marker that ends the worker, the rest of
+ *      the batch is handed back to the queue, and the worker leaves
+ *      it (see TaskQueue::leave), before it exits.
+ *
+ * Results:
+ *      Does not return.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+runWorker(Slot* slot)
+{
+    Task batch[MAX_WORKER_BATCH];
+    TaskQueue* parkQueue = options.parkPurchases ? queue : NULL;
+
+    for (;;)
+    {
+        int n = queue->dequeueBatch(batch, batchSize);
+        unsigned long long now = sthread_now_ns();
+        for (int i = 0; i < n; i++)
+            batch[i].dequeueNs = now;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (task_is_stop(batch[i]))
+            {
+                stopping.store(true);
+                continue;
+            }
+            if (!task_is_retire(batch[i]))
+            {
+                slot->busySince.store(sthread_now_ns(),
+                                      std::memory_order_relaxed);
+                handle_task(batch[i], parkQueue);
+                continue;
+            }
+            if (!leave())
+                continue;
+
+            // Never blocks, even on a full ring that only the
+            // remaining workers can drain.
+            queue->requeueBatch(&batch[i + 1], n - i - 1);
+            queue->leave();
+            slot->state.store(SLOT_EXITED);
+            sthread_exit();
+        }
+        slot->busySince.store(0, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * manage --
+ *
+ *      The body of the manager thread. Every tickNs, join exited
+ *      workers, then resize the pool as PoolOptions describes:
+ *      spawn workers until there are enough runnable ones for the
+ *      queue depth (or one more while too many are blocked), and
+ *      hand the queue a retire marker once it has stayed empty,
+ *      with workers idle, for idleNs.
+ *
+ *      Once the pool is stopping and the queue is empty, hand it a
+ *      retire marker for every live worker, and return when they
+ *      have all exited. The stops come after all other work, so
+ *      nothing can join the queue once it has drained.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+manage()
+{
+    unsigned long long idleFor = 0;
+    bool drained = false;
+
+    while (!stopping.load() || live.load() > 0)
+    {
+        sthread_sleep_until(sthread_now_ns() + options.tickNs);
+        reap(false);
+        if (stopping.load())
+        {
+            if (!drained && queue->stats().depth == 0)
+            {
+                for (int n = live.load(); n > 0; n--)
+                    retire();
+                drained = true;
+            }
+            continue;
+        }
+
+        unsigned long long now = sthread_now_ns();
+        int running = 0;
+        int blocked = 0;
+        int idle = 0;
+        for (int i = 0; i < options.maxWorkers; i++)
+        {
+            if (slots[i].state.load() != SLOT_LIVE)
+                continue;
+            running++;
+            unsigned long long since =
+                slots[i].busySince.load(std::memory_order_relaxed);
+            if (since == 0)
+                idle++;
+            else if (now > since && now - since >= options.blockedNs)
+                blocked++;
+        }
+        int depth = queue->stats().depth;
+
+        int target = blocked
+            + (depth + options.growDepth - 1) / options.growDepth;
+        if (idle == 0 && blocked > 0
+            && blocked >= options.blockedShare * running)
+            target = std::max(target, running + 1);
+        target = std::min(target, options.maxWorkers);
+        while (running < target && spawn())
+            running++;
+
+        // A marker that arrives when the pool is down to minWorkers
+        // is ignored (see leave), so markers need no bookkeeping.
+        if (depth == 0 && idle > 0 && live.load() > options.minWorkers)
+        {
+            idleFor += options.tickNs;
+            if (idleFor >= options.idleNs)
+            {
+                retire();
+                idleFor = 0;
+            }
+        }
+        else
+            idleFor = 0;
+    }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+
+#include "TaskQueue.h"
+#include "sthread.h"
+
+// Largest number of tasks a worker takes from its queue per wakeup.
+#define MAX_WORKER_BATCH 64
+
+// Most workers one WorkerPool can run at once.
+#define MAX_POOL_WORKERS 256
+
+/*
+ * How a WorkerPool sizes itself. It always runs between minWorkers
+ * and maxWorkers workers, and every tickNs its manager looks at the
+ * queue and the workers:
+ *
+ *      - a worker that has been running the same task for blockedNs
+ *        or more counts as blocked (typically parked in buyItem);
+ *      - the pool grows until it has one runnable worker per
+ *        growDepth queued tasks, and by one more worker while none
+ *        is idle and at least blockedShare of them are blocked;
+ *      - once the queue has been empty, with some worker idle, for
+ *        idleNs, one worker is retired.
+ *
+ * With parkPurchases set, workers park buyItem requests that cannot
+ * go through yet instead of blocking in them (see run_task).
+ */
+struct PoolOptions {
+    int minWorkers;
+    int maxWorkers;
+    int growDepth;
+    double blockedShare;
+    unsigned long long blockedNs;
+    unsigned long long idleNs;
+    unsigned long long tickNs;
+    bool parkPurchases;
+
+    PoolOptions()
+        : minWorkers(1), maxWorkers(64), growDepth(8), blockedShare(0.5),
+          blockedNs(1000000ULL), idleNs(10000000ULL), tickNs(1000000ULL),
+          parkPurchases(false) { }
+};
+
+/*
+ * What a WorkerPool did over its lifetime.
+ */
+struct WorkerPoolStats {
+    int live;
+    int peak;
+    long spawned;
+    long retired;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WorkerPool --
+ *
+ *      An elastic set of worker threads serving one TaskQueue. The
+ *      workers run batches of tasks as the simulator's fixed
+ *      workers do; a manager thread adds workers when the queue
+ *      backs up or workers are stuck in blocking tasks, and retires
+ *      idle ones, within the bounds of PoolOptions.
+ *
+ *      A worker is retired by a marker task the manager hands to
+ *      the queue, so it always leaves between tasks. A stop task
+ *      ends the pool: the first one a worker takes puts the pool in
+ *      its stopping state, in which no worker is added or retired,
+ *      and once the queue has drained the manager hands it one
+ *      marker per live worker. Stops themselves are only counted,
+ *      so the pool shuts down cleanly however many there are and
+ *      in whatever order the backend delivers them.
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkerPool {
+    private:
+    enum SlotState {
+        SLOT_FREE = 0,
+        SLOT_LIVE,
+        SLOT_EXITED
+    };
+
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        WorkerPool* pool;
+        sthread_t thread;
+        std::atomic<int> state;
+        // When the worker started its current task, or 0 if it is
+        // between tasks.
+        std::atomic<unsigned long long> busySince;
+
+        Slot() : pool(NULL), state(SLOT_FREE), busySince(0) { }
+    };
+
+    TaskQueue* queue;
+    const PoolOptions options;
+    const int batchSize;
+    Slot* slots;
+    sthread_t manager;
+
+    std::atomic<int> live;
+    std::atomic<bool> stopping;
+    int peak;
+    long spawned;
+    std::atomic<long> retired;
+
+    static void* workerMain(void* arg);
+    static void* managerMain(void* arg);
+
+    void runWorker(Slot* slot);
+    bool leave();
+    void retire();
+    void manage();
+    bool spawn();
+    void reap(bool wait);
+
+    public:
+    WorkerPool(TaskQueue* taskQueue, const PoolOptions& poolOptions,
+               int workerBatch);
+    ~WorkerPool();
+
+    void start();
+    void join();
+
+    WorkerPoolStats stats();
+};
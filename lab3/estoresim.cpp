@@ -1,8 +1,72 @@
+#include <atomic>
+#include <climits>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <sys/resource.h>
+#include <vector>
 
 #include "EStore.h"
+#include "LatencyStats.h"
+#include "PriorityLanes.h"
 #include "TaskQueue.h"
+#include "RequestGenerator.h"
+#include "RequestHandlers.h"
+#include "RequestPool.h"
+#include "WorkerPool.h"
+
+// Most generator threads of each kind.
+#define MAX_GENERATORS 64
+
+// Largest item id space (--items) the store can be sized for.
+#define MAX_ID_SPACE (1 << 24)
+
+/*
+ * Everything that parameterizes one simulation run. maxTasks is the
+ * number of requests per queue, split across its numGenerators
+ * generator threads; load applies to each generator thread. A
+ * nonzero updateBatch makes the suppliers send their stock, price
+ * and discount changes as feeds of that many updates, and quoteMix
+ * is the percentage of customer requests that are price quotes.
+ * agingUs is the priority queue's aging interval in microseconds,
+ * and queueLimits bound both task queues. With elastic set, each
+ * queue is served by a WorkerPool sized by poolOptions instead of
+ * numSuppliers or numCustomers fixed workers. parkPurchases makes
+ * customer workers park coarse-mode purchases that cannot go through
+ * yet instead of blocking in them.
+ */
+struct SimConfig
+{
+    int numSuppliers;
+    int numCustomers;
+    int maxTasks;
+    int numGenerators;
+    bool useFineMode;
+    TaskQueueBackend queueBackend;
+    int batchSize;
+    int updateBatch;
+    int quoteMix;
+    int agingUs;
+    LoadProfile load;
+    unsigned long seed;
+    const char* latencyCsv;
+    bool catalogReport;
+    bool queueReport;
+    bool elastic;
+    bool parkPurchases;
+    EStoreOptions storeOptions;
+    QueueLimits queueLimits;
+    PoolOptions poolOptions;
+
+    SimConfig()
+        : numSuppliers(10), numCustomers(10), maxTasks(100),
+          numGenerators(1), useFineMode(false),
+          queueBackend(TASKQUEUE_MONITOR), batchSize(8), updateBatch(0),
+          quoteMix(0), agingUs(DEFAULT_PRIORITY_AGING_NS / 1000),
+          seed(0), latencyCsv(NULL), catalogReport(false),
+          queueReport(false), elastic(false), parkPurchases(false) { }
+};
 
 class Simulation
 {
@@ -12,25 +76,79 @@ class Simulation
     EStore store;
 
     int maxTasks;
+    int numGenerators;
     int numSuppliers;
     int numCustomers;
+    int batchSize;
+    int updateBatch;
+    int quoteMix;
+    bool parkPurchases;
+    LoadProfile load;
+    unsigned long seed;
+
+    // Generator threads of each kind still producing requests; the
+    // last one to finish enqueues the stop requests (but see
+    // startSimulation for parked purchases).
+    std::atomic<int> supplierGensLeft;
+    std::atomic<int> customerGensLeft;
+
+    explicit Simulation(const SimConfig& config)
+        : supplierTasks(config.queueBackend, DEFAULT_RING_CAPACITY,
+                        config.numSuppliers),
+          customerTasks(config.queueBackend, DEFAULT_RING_CAPACITY,
+                        config.numCustomers),
+          store(config.useFineMode, config.storeOptions),
+          maxTasks(config.maxTasks), numGenerators(config.numGenerators),
+          numSuppliers(config.numSuppliers),
+          numCustomers(config.numCustomers), batchSize(config.batchSize),
+          updateBatch(config.updateBatch), quoteMix(config.quoteMix),
+          parkPurchases(config.parkPurchases), load(config.load),
+          seed(config.seed),
+          supplierGensLeft(config.numGenerators),
+          customerGensLeft(config.numGenerators) {
+        supplierTasks.setName("TaskQueue.supplier");
+        customerTasks.setName("TaskQueue.customer");
+        supplierTasks.setAging(config.agingUs * 1000ULL);
+        customerTasks.setAging(config.agingUs * 1000ULL);
+        supplierTasks.setLimits(config.queueLimits);
+        customerTasks.setLimits(config.queueLimits);
+        supplierTasks.setDiscardHook(discard_task);
+        customerTasks.setDiscardHook(discard_task);
+    }
+
+    // Generator index's share of maxTasks.
+    int generatorTasks(int index) const {
+        return maxTasks / numGenerators
+            + (index < maxTasks % numGenerators ? 1 : 0);
+    }
+};
 
-    explicit Simulation(bool useFineMode) : store(useFineMode) { }
+/*
+ * The argument to a generator thread: the simulation and which of
+ * its numGenerators generators of that kind the thread is.
+ */
+struct GeneratorArg
+{
+    Simulation* sim;
+    int index;
 };
 
 /*
  * ------------------------------------------------------------------
  * supplierGenerator --
  *
- *      The supplier generator thread. The argument is a pointer to
- *      the shared Simulation object.
+ *      A supplier generator thread. The argument is a pointer to a
+ *      GeneratorArg.
  *
- *      Enqueue arg->maxTasks requests to the supplier queue, then
- *      stop all supplier threads by enqueuing arg->numSuppliers
- *      stop requests.
+ *      Enqueue this generator's share of sim->maxTasks requests to
+ *      the supplier queue at the simulation's offered load. The
+ *      last supplier generator to finish then stops all supplier
+ *      threads by enqueuing sim->numSuppliers stop requests.
  *
  *      Use a SupplierRequestGenerator to generate and enqueue
- *      requests.
+ *      requests. The thread's random generator is seeded from the
+ *      simulation seed and the generator's index, so a fixed seed
+ *      gives the same requests.
  *
  *      This thread should exit when done.
  *
@@ -42,7 +160,18 @@ class Simulation
 static void*
 supplierGenerator(void* arg)
 {
-    // TODO: Your code here.
+    GeneratorArg* gen = (GeneratorArg*) arg;
+    Simulation* sim = gen->sim;
+    SupplierRequestGenerator generator(&sim->supplierTasks,
+                                       sim->updateBatch);
+
+    sutil_seed(sim->seed + 2 * gen->index);
+
+    generator.enqueueTasks(sim->generatorTasks(gen->index), &sim->store,
+                           sim->load);
+    if (--sim->supplierGensLeft == 0)
+        generator.enqueueStops(sim->numSuppliers);
+    sthread_exit();
     return NULL; // Keep compiler happy.
 }
 
@@ -50,18 +179,21 @@ supplierGenerator(void* arg)
  * ------------------------------------------------------------------
  * customerGenerator --
  *
- *      The customer generator thread. The argument is a pointer to
- *      the shared Simulation object.
+ *      A customer generator thread. The argument is a pointer to a
+ *      GeneratorArg.
  *
- *      Enqueue arg->maxTasks requests to the customer queue, then
- *      stop all customer threads by enqueuing arg->numCustomers
- *      stop requests.
+ *      Enqueue this generator's share of sim->maxTasks requests to
+ *      the customer queue at the simulation's offered load. The
+ *      last customer generator to finish then stops all customer
+ *      threads by enqueuing sim->numCustomers stop requests.
  *
  *      Use a CustomerRequestGenerator to generate and enqueue
  *      requests.  For the fineMode argument to the constructor
  *      of CustomerRequestGenerator, use the output of
  *      store.fineModeEnabled() method, where store is a field
- *      in the Simulation class.
+ *      in the Simulation class. The thread's random generator is
+ *      seeded on a different stream from every supplier
+ *      generator's.
  *
  *      This thread should exit when done.
  *
@@ -73,10 +205,56 @@ supplierGenerator(void* arg)
 static void*
 customerGenerator(void* arg)
 {
-    // TODO: Your code here.
+    GeneratorArg* gen = (GeneratorArg*) arg;
+    Simulation* sim = gen->sim;
+    CustomerRequestGenerator generator(&sim->customerTasks,
+                                       sim->store.fineModeEnabled(),
+                                       sim->quoteMix);
+
+    sutil_seed(sim->seed + 2 * gen->index + 1);
+
+    generator.enqueueTasks(sim->generatorTasks(gen->index), &sim->store,
+                           sim->load);
+    if (--sim->customerGensLeft == 0 && !sim->parkPurchases)
+        generator.enqueueStops(sim->numCustomers);
+    sthread_exit();
     return NULL; // Keep compiler happy.
 }
 
+/*
+ * ------------------------------------------------------------------
+ * runTasks --
+ *
+ *      Take up to batchSize Tasks from the queue at a time and run
+ *      them in order. A stop task ends the thread, so anything
+ *      behind it in the batch is handed back to the queue first.
+ *      parkQueue is as for run_task.
+ *
+ * Results:
+ *      Does not return.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+runTasks(TaskQueue* queue, int batchSize, TaskQueue* parkQueue = NULL)
+{
+    Task batch[MAX_WORKER_BATCH];
+
+    for (;;)
+    {
+        int n = queue->dequeueBatch(batch, batchSize);
+        unsigned long long now = sthread_now_ns();
+        for (int i = 0; i < n; i++)
+            batch[i].dequeueNs = now;
+        for (int i = 0; i < n; i++)
+        {
+            if (task_is_stop(batch[i]))
+                queue->requeueBatch(&batch[i + 1], n - i - 1);
+            handle_task(batch[i], parkQueue);
+        }
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * supplier --
@@ -84,7 +262,8 @@ customerGenerator(void* arg)
  *      The main supplier thread. The argument is a pointer to the
  *      shared Simulation object.
  *
- *      Dequeue Tasks from the supplier queue and execute them.
+ *      Dequeue Tasks from the supplier queue and execute them,
+ *      up to batchSize per wakeup.
  *
  * Results:
  *      Does not return.
@@ -94,7 +273,9 @@ customerGenerator(void* arg)
 static void*
 supplier(void* arg)
 {
-    // TODO: Your code here.
+    Simulation* sim = (Simulation*) arg;
+
+    runTasks(&sim->supplierTasks, sim->batchSize);
     return NULL; // Keep compiler happy.
 }
 
@@ -105,7 +286,8 @@ supplier(void* arg)
  *      The main customer thread. The argument is a pointer to the
  *      shared Simulation object.
  *
- *      Dequeue Tasks from the customer queue and execute them.
+ *      Dequeue Tasks from the customer queue and execute them,
+ *      up to batchSize per wakeup.
  *
  * Results:
  *      Does not return.
@@ -115,10 +297,69 @@ supplier(void* arg)
 static void*
 customer(void* arg)
 {
-    // TODO: Your code here.
+    Simulation* sim = (Simulation*) arg;
+
+    runTasks(&sim->customerTasks, sim->batchSize,
+             sim->parkPurchases ? &sim->customerTasks : NULL);
     return NULL; // Keep compiler happy.
 }
 
+/*
+ * Summarize the catalog the run left behind using the store's bulk
+ * scans, and time each scan.
+ */
+static void
+reportCatalog(EStore& store, FILE* out)
+{
+    std::vector<int> ids;
+    std::vector<double> costs;
+    std::vector<int> affordable;
+
+    unsigned long long start = sthread_now_ns();
+    store.effectivePrices(&ids, &costs);
+    unsigned long long priced = sthread_now_ns();
+    store.itemsUnderBudget(MIN_BUDGET, &affordable);
+    unsigned long long filtered = sthread_now_ns();
+    double value = store.stockValue();
+    unsigned long long valued = sthread_now_ns();
+
+    fprintf(out, "catalog (%s): %zu items carried, %zu in stock within %d,"
+            " stock value %.2f\n",
+            inventory_layout_name(store.inventoryLayout()), ids.size(),
+            affordable.size(), MIN_BUDGET, value);
+    fprintf(out, "catalog scans (us): prices %.1f, under budget %.1f,"
+            " stock value %.1f\n",
+            (priced - start) / 1e3, (filtered - priced) / 1e3,
+            (valued - filtered) / 1e3);
+}
+
+/*
+ * Print each task queue's depth high-water mark and how many tasks
+ * its limits turned away.
+ */
+static void
+reportQueue(const char* name, TaskQueue& queue, FILE* out)
+{
+    QueueStats s = queue.stats();
+
+    fprintf(out, "%s queue: high water %d, rejected %ld, dropped %ld,"
+            " shed %ld, sojourn avg %.1f us\n",
+            name, s.highWater, s.rejected, s.dropped, s.shed,
+            s.sojournNs / 1e3);
+}
+
+/*
+ * Print how an elastic worker pool sized itself over the run.
+ */
+static void
+reportPool(const char* name, WorkerPool& pool, FILE* out)
+{
+    WorkerPoolStats s = pool.stats();
+
+    fprintf(out, "%s pool: peak %d workers, spawned %ld, retired %ld\n",
+            name, s.peak, s.spawned, s.retired);
+}
+
 /*
  * ------------------------------------------------------------------
  * startSimulation --
@@ -126,8 +367,8 @@ customer(void* arg)
  *      the shared state for the simulation. 
  *
  *      Create the following threads:
- *          - 1 supplier generator thread.
- *          - 1 customer generator thread.
+ *          - numGenerators supplier generator threads.
+ *          - numGenerators customer generator threads.
  *          - numSuppliers supplier threads.
  *          - numCustomers customer threads.
  *
@@ -135,31 +376,359 @@ customer(void* arg)
  *      should wait until all of them exit, at which point it
  *      should return.
  *
+ *      Once every supplier has exited nothing can restock or
+ *      reprice the store, so it is closed before waiting for the
+ *      customers; otherwise a customer blocked in buyItem would
+ *      never exit.
+ *
  *      Hint: Use sthread_join.
  *
+ *      With config.elastic, the supplier and customer threads are
+ *      instead the workers of two WorkerPools, which grow and
+ *      shrink with their queues.
+ *
+ *      With config.parkPurchases, a parked purchase is handed back
+ *      to the customer queue whenever a supplier change (or the
+ *      store closing) may let it through, so the customers must
+ *      outlive the store: their stop requests are enqueued only
+ *      after close, behind every purchase it resumed.
+ *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(const SimConfig& config)
+{
+    Simulation sim(config);
+
+    int numGens = sim.numGenerators;
+    GeneratorArg* genArgs = new GeneratorArg[numGens];
+    sthread_t* supplierGens = new sthread_t[numGens];
+    sthread_t* customerGens = new sthread_t[numGens];
+    sthread_t* suppliers = new sthread_t[sim.numSuppliers];
+    sthread_t* customers = new sthread_t[sim.numCustomers];
+    WorkerPool* supplierPool = NULL;
+    WorkerPool* customerPool = NULL;
+
+    for (int i = 0; i < numGens; i++)
+    {
+        genArgs[i].sim = &sim;
+        genArgs[i].index = i;
+        sthread_create(&supplierGens[i], supplierGenerator, &genArgs[i]);
+        sthread_create(&customerGens[i], customerGenerator, &genArgs[i]);
+    }
+    if (config.elastic)
+    {
+        supplierPool = new WorkerPool(&sim.supplierTasks, config.poolOptions,
+                                      sim.batchSize);
+        PoolOptions customerOptions = config.poolOptions;
+        customerOptions.parkPurchases = config.parkPurchases;
+        customerPool = new WorkerPool(&sim.customerTasks, customerOptions,
+                                      sim.batchSize);
+        supplierPool->start();
+        customerPool->start();
+    }
+    else
+    {
+        for (int i = 0; i < sim.numSuppliers; i++)
+            sthread_create(&suppliers[i], supplier, &sim);
+        for (int i = 0; i < sim.numCustomers; i++)
+            sthread_create(&customers[i], customer, &sim);
+    }
+
+    for (int i = 0; i < numGens; i++)
+        sthread_join(supplierGens[i]);
+    if (supplierPool)
+        supplierPool->join();
+    else
+    {
+        for (int i = 0; i < sim.numSuppliers; i++)
+            sthread_join(suppliers[i]);
+    }
+
+    sim.store.close();
+
+    for (int i = 0; i < numGens; i++)
+        sthread_join(customerGens[i]);
+    if (sim.parkPurchases)
+    {
+        CustomerRequestGenerator stopper(&sim.customerTasks,
+                                         sim.store.fineModeEnabled());
+        stopper.enqueueStops(sim.numCustomers);
+    }
+    if (customerPool)
+        customerPool->join();
+    else
+    {
+        for (int i = 0; i < sim.numCustomers; i++)
+            sthread_join(customers[i]);
+    }
+
+    if (config.catalogReport)
+        reportCatalog(sim.store, stdout);
+    if (config.queueReport)
+    {
+        reportQueue("supplier", sim.supplierTasks, stdout);
+        reportQueue("customer", sim.customerTasks, stdout);
+        if (config.elastic)
+        {
+            reportPool("supplier", *supplierPool, stdout);
+            reportPool("customer", *customerPool, stdout);
+        }
+    }
+
+    delete[] genArgs;
+    delete[] supplierGens;
+    delete[] customerGens;
+    delete[] suppliers;
+    delete[] customers;
+    delete supplierPool;
+    delete customerPool;
+}
+
+/*
+ * Print the latency of each request type in the run that just
+ * finished, and write it to config.latencyCsv as well if that is set.
+ */
+static void
+reportLatency(const SimConfig& config)
 {
-    // TODO: Your code here.
+    latency_report(stdout);
+    if (config.latencyCsv == NULL)
+        return;
+
+    FILE* csv = fopen(config.latencyCsv, "w");
+    if (csv == NULL)
+    {
+        perror(config.latencyCsv);
+        return;
+    }
+    latency_write_csv(csv);
+    fclose(csv);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runBenchmark --
+ *
+ *      Run the simulation once for every combination of thread
+ *      count (as many customers as suppliers), task count, store
+ *      mode (coarse, coarse with flat combining, or fine) and queue
+ *      backend, and write one CSV line per run to out: the
+ *      configuration, throughput in requests per second, queueing
+ *      and service latency percentiles in microseconds, and the
+ *      voluntary and involuntary context switches the process made.
+ *
+ *      Everything else comes from base. Generators run as fast as
+ *      possible unless base asks for another open-loop process.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+runBenchmark(const SimConfig& base, FILE* out)
+{
+    static const int threadCounts[] = { 1, 2, 4, 8, 16 };
+    static const int taskCounts[] = { 1000, 10000 };
+    static const char* modeNames[] = { "coarse", "combining", "fine" };
+    const int numThreadCounts = sizeof(threadCounts) / sizeof(threadCounts[0]);
+    const int numTaskCounts = sizeof(taskCounts) / sizeof(taskCounts[0]);
+    const int numModes = sizeof(modeNames) / sizeof(modeNames[0]);
+
+    fprintf(out, "suppliers,customers,tasks,mode,queue,arrivals,elapsed_s,"
+            "throughput_rps,queue_p50_us,queue_p99_us,queue_p999_us,"
+            "service_p50_us,service_p99_us,service_p999_us,"
+            "voluntary_csw,involuntary_csw\n");
+
+    for (int t = 0; t < numThreadCounts; t++)
+    for (int n = 0; n < numTaskCounts; n++)
+    for (int mode = 0; mode < numModes; mode++)
+    for (int b = 0; b < NUM_TASKQUEUE_BACKENDS; b++)
+    {
+        SimConfig config = base;
+        config.numSuppliers = threadCounts[t];
+        config.numCustomers = threadCounts[t];
+        config.maxTasks = taskCounts[n];
+        config.useFineMode = mode == 2;
+        config.storeOptions.flatCombining = mode == 1;
+        config.queueBackend = (TaskQueueBackend) b;
+        if (config.load.arrivals == ARRIVAL_PACED)
+            config.load.arrivals = ARRIVAL_AFAP;
+
+        struct rusage before, after;
+        latency_reset();
+        getrusage(RUSAGE_SELF, &before);
+        unsigned long long start = sthread_now_ns();
+        startSimulation(config);
+        double elapsed = (sthread_now_ns() - start) / 1e9;
+        getrusage(RUSAGE_SELF, &after);
+
+        LatencyHistogram queue, service;
+        latency_merge(LATENCY_QUEUE, &queue);
+        latency_merge(LATENCY_SERVICE, &service);
+
+        fprintf(out, "%d,%d,%d,%s,%s,%s,%.6f,%.0f,"
+                "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%ld\n",
+                config.numSuppliers, config.numCustomers, config.maxTasks,
+                modeNames[mode],
+                taskqueue_backend_name(config.queueBackend),
+                arrival_process_name(config.load.arrivals), elapsed,
+                2.0 * config.maxTasks / elapsed,
+                queue.percentile(0.50) / 1e3, queue.percentile(0.99) / 1e3,
+                queue.percentile(0.999) / 1e3,
+                service.percentile(0.50) / 1e3,
+                service.percentile(0.99) / 1e3,
+                service.percentile(0.999) / 1e3,
+                after.ru_nvcsw - before.ru_nvcsw,
+                after.ru_nivcsw - before.ru_nivcsw);
+        fflush(out);
+    }
+}
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--fine] [--wait] [--combine]"
+            " [--queue=monitor|ring|steal|priority] [--aging-us=N]"
+            " [--batch=N] [--burst=N] [--stripes=N] [--items=N] [--seed=N]"
+            " [--layout=aos|soa] [--catalog] [--update-batch=N]"
+            " [--quote-mix=PERCENT]"
+            " [--arrivals=paced|constant|poisson|afap] [--rate=N]"
+            " [--generators=N] [--tasks=N] [--latency-csv=FILE]"
+            " [--capacity=N] [--overflow=block|reject|drop-oldest]"
+            " [--admission-us=N] [--queue-stats]"
+            " [--elastic] [--min-workers=N] [--max-workers=N] [--park]"
+            " [--pool-stats] [--bench]\n", prog);
+    exit(1);
+}
+
+/*
+ * If arg is "<name>N", parse N into *value and check that it lies in
+ * [min, max]. Returns false if arg is some other option.
+ */
+static bool
+int_option(const char* arg, const char* name, int min, int max, int* value,
+           const char* prog)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0)
+        return false;
+    *value = atoi(arg + len);
+    if (*value < min || *value > max)
+        usage(prog);
+    return true;
 }
 
 int main(int argc, char **argv)
 {
-    bool useFineMode = false;
+    SimConfig config;
+    bool poolStats = false;
+    bool bench = false;
+    int seed = -1;
+    int rate = 0;
+    int admissionUs = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--fine") == 0)
+            config.useFineMode = true;
+        else if (strcmp(arg, "--wait") == 0)
+            config.storeOptions.waitForOrders = true;
+        else if (strcmp(arg, "--combine") == 0)
+            config.storeOptions.flatCombining = true;
+        else if (strcmp(arg, "--pool-stats") == 0)
+            poolStats = true;
+        else if (strcmp(arg, "--queue-stats") == 0)
+            config.queueReport = true;
+        else if (strcmp(arg, "--elastic") == 0)
+            config.elastic = true;
+        else if (strcmp(arg, "--park") == 0)
+            config.parkPurchases = true;
+        else if (strncmp(arg, "--overflow=", 11) == 0)
+        {
+            if (!overflow_policy_parse(arg + 11,
+                                       &config.queueLimits.overflow))
+                usage(argv[0]);
+        }
+        else if (strcmp(arg, "--bench") == 0)
+            bench = true;
+        else if (strcmp(arg, "--catalog") == 0)
+            config.catalogReport = true;
+        else if (strncmp(arg, "--layout=", 9) == 0)
+        {
+            if (!inventory_layout_parse(arg + 9, &config.storeOptions.layout))
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--queue=", 8) == 0)
+        {
+            if (!taskqueue_backend_parse(arg + 8, &config.queueBackend))
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--latency-csv=", 14) == 0)
+            config.latencyCsv = arg + 14;
+        else if (strncmp(arg, "--arrivals=", 11) == 0)
+        {
+            if (!arrival_process_parse(arg + 11, &config.load.arrivals))
+                usage(argv[0]);
+        }
+        else if (!int_option(arg, "--batch=", 1, MAX_WORKER_BATCH,
+                             &config.batchSize, argv[0])
+                 && !int_option(arg, "--update-batch=", 1, MAX_UPDATES,
+                                &config.updateBatch, argv[0])
+                 && !int_option(arg, "--quote-mix=", 0, 100,
+                                &config.quoteMix, argv[0])
+                 && !int_option(arg, "--aging-us=", 0, INT_MAX,
+                                &config.agingUs, argv[0])
+                 && !int_option(arg, "--capacity=", 1, INT_MAX,
+                                &config.queueLimits.capacity, argv[0])
+                 && !int_option(arg, "--admission-us=", 1, INT_MAX,
+                                &admissionUs, argv[0])
+                 && !int_option(arg, "--min-workers=", 1, MAX_POOL_WORKERS,
+                                &config.poolOptions.minWorkers, argv[0])
+                 && !int_option(arg, "--max-workers=", 1, MAX_POOL_WORKERS,
+                                &config.poolOptions.maxWorkers, argv[0])
+                 && !int_option(arg, "--burst=", 1, MAX_BURST,
+                                &config.load.burst, argv[0])
+                 && !int_option(arg, "--rate=", 1, INT_MAX, &rate, argv[0])
+                 && !int_option(arg, "--generators=", 1, MAX_GENERATORS,
+                                &config.numGenerators, argv[0])
+                 && !int_option(arg, "--tasks=", 0, INT_MAX,
+                                &config.maxTasks, argv[0])
+                 && !int_option(arg, "--stripes=", 1, INT_MAX,
+                                &config.storeOptions.lockStripes, argv[0])
+                 && !int_option(arg, "--items=", 1, MAX_ID_SPACE,
+                                &config.storeOptions.idSpace, argv[0])
+                 && !int_option(arg, "--seed=", 0, INT_MAX, &seed, argv[0]))
+            usage(argv[0]);
+    }
 
-    // Seed the random number generator.
-    // You can remove this line or set it to some constant to get deterministic
-    // results, but make sure you put it back before turning in.
-    srand(time(NULL));
+    if (rate > 0)
+        config.load.rate = rate;
+    if (config.poolOptions.minWorkers > config.poolOptions.maxWorkers)
+        usage(argv[0]);
+    if (admissionUs > 0)
+        config.queueLimits.targetSojournNs = admissionUs * 1000ULL;
 
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    // Seed the random number generators. --seed=N makes the generated
+    // requests the same on every run; by default they differ.
+    config.seed = seed >= 0 ? (unsigned long) seed : (unsigned long) time(NULL);
+    srand(config.seed);
+
+    if (bench)
+        runBenchmark(config, stdout);
+    else
+    {
+        startSimulation(config);
+        reportLatency(config);
+    }
+
+    if (poolStats)
+        request_pool_report(stdout);
     return 0;
 }
-
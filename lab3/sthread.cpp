@@ -8,78 +8,480 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sched.h>
 
-void smutex_init(smutex_t *mutex)
+#ifdef STHREAD_PROFILE
+
+#include <atomic>
+#include <string.h>
+
+/*
+ * The statistics shared by every mutex, or every condition variable,
+ * with one name. Records are never freed, so a mutex can be destroyed
+ * without losing its counts.
+ */
+struct sprofile {
+  const char *name;
+  int isCond;
+
+  // Mutexes.
+  std::atomic<unsigned long> acquires;
+  std::atomic<unsigned long> contended;
+  std::atomic<unsigned long long> waitNs;
+  std::atomic<unsigned long long> holdNs;
+
+  // Condition variables.
+  std::atomic<unsigned long> waits;
+  std::atomic<unsigned long> spurious;
+  std::atomic<unsigned long long> blockedNs;
+
+  struct sprofile *next;
+};
+
+static pthread_mutex_t sprofile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sprofile *sprofiles = NULL;
+
+static void sprofile_dump(void);
+
+static struct sprofile *sprofile_lookup(const char *name, int isCond)
+{
+  struct sprofile *p;
+
+  pthread_mutex_lock(&sprofile_lock);
+  for(p = sprofiles; p != NULL; p = p->next){
+    if(p->isCond == isCond && strcmp(p->name, name) == 0){
+      break;
+    }
+  }
+  if(p == NULL){
+    if(sprofiles == NULL){
+      atexit(sprofile_dump);
+    }
+    p = new sprofile();
+    p->name = name;
+    p->isCond = isCond;
+    p->next = sprofiles;
+    sprofiles = p;
+  }
+  pthread_mutex_unlock(&sprofile_lock);
+  return p;
+}
+
+static void sprofile_add(std::atomic<unsigned long long> *total,
+                         unsigned long long ns)
+{
+  total->fetch_add(ns, std::memory_order_relaxed);
+}
+
+static void sprofile_count(std::atomic<unsigned long> *counter)
+{
+  counter->fetch_add(1, std::memory_order_relaxed);
+}
+
+static int sprofile_by_wait(const void *a, const void *b)
+{
+  const struct sprofile *pa = *(const struct sprofile * const *) a;
+  const struct sprofile *pb = *(const struct sprofile * const *) b;
+  unsigned long long wa = pa->isCond ? pa->blockedNs.load() : pa->waitNs.load();
+  unsigned long long wb = pb->isCond ? pb->blockedNs.load() : pb->waitNs.load();
+  return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/*
+ * Print every record with activity, mutexes then condition
+ * variables, the ones with the most time spent blocked first.
+ */
+static void sprofile_dump(void)
+{
+  struct sprofile *p;
+  struct sprofile **all;
+  int n = 0, i;
+
+  pthread_mutex_lock(&sprofile_lock);
+  for(p = sprofiles; p != NULL; p = p->next){
+    n++;
+  }
+  all = new struct sprofile *[n];
+  n = 0;
+  for(p = sprofiles; p != NULL; p = p->next){
+    all[n++] = p;
+  }
+  pthread_mutex_unlock(&sprofile_lock);
+  qsort(all, n, sizeof(all[0]), sprofile_by_wait);
+
+  fprintf(stderr, "%-24s %10s %10s %12s %12s\n", "mutex", "acquires",
+          "contended", "wait ms", "hold ms");
+  for(i = 0; i < n; i++){
+    p = all[i];
+    if(!p->isCond && p->acquires.load() > 0){
+      fprintf(stderr, "%-24s %10lu %10lu %12.3f %12.3f\n", p->name,
+              p->acquires.load(), p->contended.load(),
+              p->waitNs.load() / 1e6, p->holdNs.load() / 1e6);
+    }
+  }
+  fprintf(stderr, "%-24s %10s %10s %12s\n", "condvar", "waits", "spurious",
+          "blocked ms");
+  for(i = 0; i < n; i++){
+    p = all[i];
+    if(p->isCond && p->waits.load() > 0){
+      fprintf(stderr, "%-24s %10lu %10lu %12.3f\n", p->name,
+              p->waits.load(), p->spurious.load(), p->blockedNs.load() / 1e6);
+    }
+  }
+  delete[] all;
+}
+
+void smutex_set_name(smutex_t *mutex, const char *name)
+{
+  mutex->prof = sprofile_lookup(name, 0);
+}
+
+void scond_set_name(scond_t *cond, const char *name)
+{
+  cond->prof = sprofile_lookup(name, 1);
+}
+
+#define PMUTEX(m) (&(m)->mutex)
+#define PCOND(c) (&(c)->cond)
+
+#else
+
+#define PMUTEX(m) (m)
+#define PCOND(c) (c)
+
+#endif
+
+
+#ifdef STHREAD_FUTEX
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Spin limits for a contended lock: a mutex spins for up to twice
+ * its recent average plus FUTEX_SPIN_MIN tries, and never more than
+ * FUTEX_SPIN_MAX, before it sleeps.
+ */
+#define FUTEX_SPIN_MIN 10
+#define FUTEX_SPIN_MAX 100
+
+static long sys_futex(int *uaddr, int op, int val, long val2, int *uaddr2,
+                      int val3)
+{
+  return syscall(SYS_futex, uaddr, op, val, val2, uaddr2, val3);
+}
+
+/*
+ * Sleep while *uaddr == val. Returning early (the value changed, or
+ * a signal arrived) is fine: every caller re-checks.
+ */
+static void futex_wait(int *uaddr, int val)
+{
+  if(sys_futex(uaddr, FUTEX_WAIT_PRIVATE, val, 0, NULL, 0) == -1
+     && errno != EAGAIN && errno != EINTR){
+    perror("futex wait failed");
+    exit(-1);
+  }
+}
+
+static void futex_wake(int *uaddr, int n)
+{
+  if(sys_futex(uaddr, FUTEX_WAKE_PRIVATE, n, 0, NULL, 0) == -1){
+    perror("futex wake failed");
+    exit(-1);
+  }
+}
+
+/* Compare-and-swap on a futex word; returns the old value. */
+static int futex_cas(int *uaddr, int expected, int desired)
+{
+  __atomic_compare_exchange_n(uaddr, &expected, desired, 0,
+                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  return expected;
+}
+
+static void rawmutex_init(sthread_rawmutex_t *m)
+{
+  m->state = 0;
+  m->spins = 0;
+}
+
+static void rawmutex_destroy(sthread_rawmutex_t *m __attribute__((unused)))
+{
+}
+
+static int rawmutex_trylock(sthread_rawmutex_t *m)
+{
+  return futex_cas(&m->state, 0, 1) == 0;
+}
+
+static void rawmutex_lock(sthread_rawmutex_t *m)
+{
+  int spins, limit, i;
+
+  if(futex_cas(&m->state, 0, 1) == 0){
+    return;
+  }
+
+  // The critical sections this library guards are short, so the
+  // holder will often let go within a few hundred cycles: spin
+  // before paying for a sleep and a wakeup.
+  spins = __atomic_load_n(&m->spins, __ATOMIC_RELAXED);
+  limit = 2 * spins + FUTEX_SPIN_MIN;
+  if(limit > FUTEX_SPIN_MAX){
+    limit = FUTEX_SPIN_MAX;
+  }
+  for(i = 0; i < limit; i++){
+    sthread_relax();
+    if(__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0
+       && futex_cas(&m->state, 0, 1) == 0){
+      __atomic_store_n(&m->spins, spins + (i - spins) / 8, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  // Mark the mutex contended so that the unlock wakes us.
+  while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0){
+    futex_wait(&m->state, 2);
+  }
+  __atomic_store_n(&m->spins, spins + (limit - spins) / 8, __ATOMIC_RELAXED);
+}
+
+static void rawmutex_unlock(sthread_rawmutex_t *m)
+{
+  if(__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1){
+    __atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+    futex_wake(&m->state, 1);
+  }
+}
+
+static void rawcond_init(sthread_rawcond_t *c)
+{
+  c->seq = 0;
+}
+
+static void rawcond_destroy(sthread_rawcond_t *c __attribute__((unused)))
+{
+}
+
+static void rawcond_signal(sthread_rawcond_t *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELAXED);
+  futex_wake(&c->seq, 1);
+}
+
+/*
+ * Wake one waiter and requeue the rest onto the mutex, which the
+ * caller holds. Marking the mutex contended first makes the caller's
+ * unlock wake the next of them.
+ */
+static void rawcond_broadcast(sthread_rawcond_t *c, sthread_rawmutex_t *m)
+{
+  int seq = __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELAXED);
+
+  futex_cas(&m->state, 1, 2);
+  while(sys_futex(&c->seq, FUTEX_CMP_REQUEUE_PRIVATE, 1, INT_MAX,
+                  &m->state, seq) == -1){
+    if(errno != EAGAIN){
+      perror("futex requeue failed");
+      exit(-1);
+    }
+    seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+  }
+}
+
+static void rawcond_wait(sthread_rawcond_t *c, sthread_rawmutex_t *m)
+{
+  int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+
+  rawmutex_unlock(m);
+  futex_wait(&c->seq, seq);
+
+  // A broadcast may have moved us onto the mutex word, so take the
+  // mutex as contended: whoever unlocks it next must wake the rest.
+  while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0){
+    futex_wait(&m->state, 2);
+  }
+}
+
+#else
+
+static void rawmutex_init(sthread_rawmutex_t *m)
 {
-  if(pthread_mutex_init(mutex, NULL)){
+  if(pthread_mutex_init(m, NULL)){
       perror("pthread_mutex_init failed");
       exit(-1);
   }    
 }
 
-void smutex_destroy(smutex_t *mutex)
+static void rawmutex_destroy(sthread_rawmutex_t *m)
 {
-  if(pthread_mutex_destroy(mutex)){
+  if(pthread_mutex_destroy(m)){
       perror("pthread_mutex_destroy failed");
       exit(-1);
   }    
 }
 
-void smutex_lock(smutex_t *mutex)
+static int rawmutex_trylock(sthread_rawmutex_t *m)
+{
+  int err = pthread_mutex_trylock(m);
+  if(err != 0 && err != EBUSY){
+    errno = err;
+    perror("pthread_mutex_trylock failed");
+    exit(-1);
+  }
+  return err == 0;
+}
+
+static void rawmutex_lock(sthread_rawmutex_t *m)
 {
-  if(pthread_mutex_lock(mutex)){
+  if(pthread_mutex_lock(m)){
     perror("pthread_mutex_lock failed");
     exit(-1);
   }    
 }
 
-void smutex_unlock(smutex_t *mutex)
+static void rawmutex_unlock(sthread_rawmutex_t *m)
 {
-  if(pthread_mutex_unlock(mutex)){
+  if(pthread_mutex_unlock(m)){
     perror("pthread_mutex_unlock failed");
     exit(-1);
   }    
 }
 
-
-
-void scond_init(scond_t *cond)
+static void rawcond_init(sthread_rawcond_t *c)
 {
-  if(pthread_cond_init(cond, NULL)){
+  if(pthread_cond_init(c, NULL)){
       perror("pthread_cond_init failed");
       exit(-1);
   }
 }
 
-void scond_destroy(scond_t *cond)
+static void rawcond_destroy(sthread_rawcond_t *c)
 {
-  if(pthread_cond_destroy(cond)){
+  if(pthread_cond_destroy(c)){
       perror("pthread_cond_destroy failed");
       exit(-1);
   }
 }
 
+static void rawcond_signal(sthread_rawcond_t *c)
+{
+  if(pthread_cond_signal(c)){
+    perror("pthread_cond_signal failed");
+    exit(-1);
+  }
+}
+
+static void rawcond_broadcast(sthread_rawcond_t *c,
+                              sthread_rawmutex_t *m __attribute__((unused)))
+{
+  if(pthread_cond_broadcast(c)){
+    perror("pthread_cond_broadcast failed");
+    exit(-1);
+  }
+}
+
+static void rawcond_wait(sthread_rawcond_t *c, sthread_rawmutex_t *m)
+{
+  if(pthread_cond_wait(c, m)){
+    perror("pthread_cond_wait failed");
+    exit(-1);
+  }
+}
+
+#endif
+
+void smutex_init(smutex_t *mutex)
+{
+  rawmutex_init(PMUTEX(mutex));
+#ifdef STHREAD_PROFILE
+  mutex->prof = sprofile_lookup("(unnamed)", 0);
+  mutex->lockedAt = 0;
+#endif
+}
+
+void smutex_destroy(smutex_t *mutex)
+{
+  rawmutex_destroy(PMUTEX(mutex));
+}
+
+void smutex_lock(smutex_t *mutex)
+{
+#ifdef STHREAD_PROFILE
+  if(rawmutex_trylock(PMUTEX(mutex))){
+    mutex->lockedAt = sthread_now_ns();
+  } else {
+    unsigned long long start = sthread_now_ns();
+    rawmutex_lock(PMUTEX(mutex));
+    mutex->lockedAt = sthread_now_ns();
+    sprofile_count(&mutex->prof->contended);
+    sprofile_add(&mutex->prof->waitNs, mutex->lockedAt - start);
+  }
+  sprofile_count(&mutex->prof->acquires);
+#else
+  rawmutex_lock(mutex);
+#endif
+}
+
+int smutex_trylock(smutex_t *mutex)
+{
+  if(!rawmutex_trylock(PMUTEX(mutex))){
+    return 0;
+  }
+#ifdef STHREAD_PROFILE
+  mutex->lockedAt = sthread_now_ns();
+  sprofile_count(&mutex->prof->acquires);
+#endif
+  return 1;
+}
+
+void smutex_unlock(smutex_t *mutex)
+{
+#ifdef STHREAD_PROFILE
+  sprofile_add(&mutex->prof->holdNs, sthread_now_ns() - mutex->lockedAt);
+#endif
+  rawmutex_unlock(PMUTEX(mutex));
+}
+
+
+
+void scond_init(scond_t *cond)
+{
+  rawcond_init(PCOND(cond));
+#ifdef STHREAD_PROFILE
+  cond->prof = sprofile_lookup("(unnamed)", 1);
+  cond->signals = 0;
+#endif
+}
+
+void scond_destroy(scond_t *cond)
+{
+  rawcond_destroy(PCOND(cond));
+}
+
 void scond_signal(scond_t *cond, smutex_t *mutex __attribute__((unused)))
 {
   //
   // assert(mutex is held by this thread);
   //
 
-  if(pthread_cond_signal(cond)){
-    perror("pthread_cond_signal failed");
-    exit(-1);
-  }
+#ifdef STHREAD_PROFILE
+  cond->signals++;
+#endif
+  rawcond_signal(PCOND(cond));
 }
 
-void scond_broadcast(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+void scond_broadcast(scond_t *cond, smutex_t *mutex)
 {
   //
   // assert(mutex is held by this thread);
   //
-  if(pthread_cond_broadcast(cond)){
-    perror("pthread_cond_broadcast failed");
-    exit(-1);
-  }
+#ifdef STHREAD_PROFILE
+  cond->signals++;
+#endif
+  rawcond_broadcast(PCOND(cond), PMUTEX(mutex));
 }
 
 void scond_wait(scond_t *cond, smutex_t *mutex)
@@ -88,10 +490,22 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
   // assert(mutex is held by this thread);
   //
 
-  if(pthread_cond_wait(cond, mutex)){
-    perror("pthread_cond_wait failed");
-    exit(-1);
+#ifdef STHREAD_PROFILE
+  // The mutex is not held while blocked: count that as a release
+  // and a fresh acquisition on wakeup.
+  unsigned long signals = cond->signals;
+  unsigned long long start = sthread_now_ns();
+  sprofile_add(&mutex->prof->holdNs, start - mutex->lockedAt);
+#endif
+  rawcond_wait(PCOND(cond), PMUTEX(mutex));
+#ifdef STHREAD_PROFILE
+  mutex->lockedAt = sthread_now_ns();
+  sprofile_count(&cond->prof->waits);
+  sprofile_add(&cond->prof->blockedNs, mutex->lockedAt - start);
+  if(cond->signals == signals){
+    sprofile_count(&cond->prof->spurious);
   }
+#endif
 }
 
 
@@ -152,6 +566,43 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
   }
 }
 
+unsigned long long sthread_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sthread_sleep_until(unsigned long long deadline_ns)
+{
+  struct timespec rqt;
+  int err;
+  rqt.tv_sec = deadline_ns / 1000000000ULL;
+  rqt.tv_nsec = deadline_ns % 1000000000ULL;
+  while((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &rqt, NULL))
+        == EINTR){
+  }
+  if(err != 0){
+    errno = err;
+    perror("sleep failed");
+    exit(-1);
+  }
+}
+
+void sthread_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  sched_yield();
+#endif
+}
+
+void sthread_yield(void)
+{
+  sched_yield();
+}
+
 
 /*
  * random() in stdlib.h is not MT-safe, so we need to lock
@@ -176,3 +627,60 @@ long sutil_random()
   return val;
     
 }
+
+
+/*
+ * Per-thread xoshiro256** state. Seeds go through splitmix64 first,
+ * so nearby seeds (seed, seed + 1, ...) give unrelated streams and the
+ * state is never all zero.
+ */
+static thread_local unsigned long long surand_state[4];
+static thread_local int surand_seeded = 0;
+
+static unsigned long long splitmix64(unsigned long long *x)
+{
+  unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static unsigned long long rotl(unsigned long long x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+void sutil_seed(unsigned long seed)
+{
+  unsigned long long x = seed;
+  int i;
+
+  for(i = 0; i < 4; i++){
+    surand_state[i] = splitmix64(&x);
+  }
+  surand_seeded = 1;
+}
+
+long sutil_rand()
+{
+  unsigned long long *s = surand_state;
+  unsigned long long result, t;
+
+  if(!surand_seeded){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sutil_seed((unsigned long) now.tv_nsec ^ ((unsigned long) now.tv_sec << 32)
+               ^ (unsigned long) pthread_self());
+  }
+
+  result = rotl(s[1] * 5, 7) * 9;
+  t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return (long) ((result >> 11) % ((unsigned long long) RAND_MAX + 1));
+}
@@ -11,8 +11,65 @@ nanosleep}.
 #include <pthread.h>
 #include <unistd.h>
 
-typedef pthread_mutex_t smutex_t;
-typedef pthread_cond_t scond_t;
+/*
+ * Size of a cache line. Align data written by different threads to
+ * this to keep it from false sharing.
+ */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * The primitives underneath smutex_t and scond_t. Normally these are
+ * pthread objects. Build with -DSTHREAD_FUTEX (make FUTEX=1) to use
+ * Linux futexes instead:
+ *
+ *      The mutex word is 0 when free, 1 when held and 2 when held
+ *      with possible sleepers. A contended lock spins for a while
+ *      before sleeping; spins tracks how long recent acquisitions
+ *      spun, and the spin limit adapts to it.
+ *
+ *      The condition variable is a sequence number that signals
+ *      and broadcasts bump. A broadcast wakes one waiter and moves
+ *      the rest onto the mutex word (FUTEX_CMP_REQUEUE), so they
+ *      are woken one unlock at a time instead of all at once.
+ */
+#ifdef STHREAD_FUTEX
+typedef struct {
+  int state;
+  int spins;
+} sthread_rawmutex_t;
+
+typedef struct {
+  int seq;
+} sthread_rawcond_t;
+#else
+typedef pthread_mutex_t sthread_rawmutex_t;
+typedef pthread_cond_t sthread_rawcond_t;
+#endif
+
+#ifdef STHREAD_PROFILE
+struct sprofile;
+
+/*
+ * In a profiling build every mutex and condition variable points to
+ * the statistics record for its name (see smutex_set_name below).
+ * lockedAt is when the current holder took the mutex; signals counts
+ * the signals and broadcasts, to tell spurious wakeups apart.
+ */
+typedef struct {
+  sthread_rawmutex_t mutex;
+  struct sprofile *prof;
+  unsigned long long lockedAt;
+} smutex_t;
+
+typedef struct {
+  sthread_rawcond_t cond;
+  struct sprofile *prof;
+  unsigned long signals;
+} scond_t;
+#else
+typedef sthread_rawmutex_t smutex_t;
+typedef sthread_rawcond_t scond_t;
+#endif
 typedef pthread_t sthread_t;
 
 void smutex_init(smutex_t *mutex);
@@ -20,6 +77,12 @@ void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
 
+/*
+ * Take the mutex only if it is free. Returns nonzero if the caller
+ * now holds it, 0 (without blocking) if another thread does.
+ */
+int smutex_trylock(smutex_t *mutex);
+
 void scond_init(scond_t *cond);
 void scond_destroy(scond_t *cond);
 
@@ -35,6 +98,29 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Lock profiling. Build with -DSTHREAD_PROFILE (make PROFILE=1) and
+ * each mutex counts its acquisitions, the acquisitions that had to
+ * block, the time spent blocked acquiring it and the time it was
+ * held; each condition variable counts its waits, the time spent
+ * blocked in them, and the wakeups that came with no signal or
+ * broadcast since the wait began (spurious wakeups). The totals are
+ * printed to stderr at exit.
+ *
+ * Statistics are kept per name, so that (say) all item locks add up
+ * to one line. Naming a mutex or condition variable files it under
+ * that name, which must stay valid until exit (use a literal);
+ * unnamed ones add up under "(unnamed)". In a normal build naming
+ * does nothing.
+ */
+#ifdef STHREAD_PROFILE
+void smutex_set_name(smutex_t *mutex, const char *name);
+void scond_set_name(scond_t *cond, const char *name);
+#else
+static inline void smutex_set_name(smutex_t *mutex, const char *name) { }
+static inline void scond_set_name(scond_t *cond, const char *name) { }
+#endif
+
 
 
 void sthread_create(sthread_t *thrd,
@@ -60,6 +146,27 @@ void sthread_join(sthread_t thrd);
  */
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * Monotonic clock, in nanoseconds since an arbitrary start. Sleeping
+ * until an absolute time keeps a periodic schedule from drifting by
+ * the time spent between sleeps.
+ */
+unsigned long long sthread_now_ns(void);
+void sthread_sleep_until(unsigned long long deadline_ns);
+
+/*
+ * Hint to the CPU that the caller is busy-waiting. Use this in
+ * short, bounded spin loops before falling back to a condition
+ * variable -- never as a substitute for one.
+ */
+void sthread_relax(void);
+
+/*
+ * Give up the CPU to another runnable thread, if there is one. For
+ * spin loops that may outlast the holder's time slice.
+ */
+void sthread_yield(void);
+
 
 /*
  * The normal random() library is not thread safe,
@@ -67,5 +174,16 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
  */
 long sutil_random(void);
 
+/*
+ * A lock-free alternative: each thread has its own xoshiro256**
+ * generator. sutil_rand() returns a value in [0, RAND_MAX] like
+ * random(). sutil_seed() seeds the calling thread's generator, so a
+ * thread that seeds itself with a fixed value draws the same sequence
+ * on every run; a thread that never calls it is seeded from the clock
+ * on its first draw.
+ */
+void sutil_seed(unsigned long seed);
+long sutil_rand(void);
+
 #endif
 